@@ -0,0 +1,149 @@
+#include <fcntl.h>
+#include <math.h>
+
+#include <algorithm>
+#include <boost/program_options.hpp>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "alltoall.h"
+
+using namespace std;
+
+int main(int argc, char *argv[]) {
+	int num_procs, entries_per_cell;
+	int *rbuf, *sbuf;
+	string tuning_file;
+	struct alltoall_choice choice;
+	struct alltoall_handle handle;
+	int iterations;
+
+	boost::program_options::options_description desc("Allowed options");
+	desc.add_options()("help", "show possible options")(
+		"rank", boost::program_options::value<int>(), "rank")(
+		"num_procs", boost::program_options::value<int>(), "num_procs")(
+		"entries_per_cell", boost::program_options::value<int>(),
+		"entries_per_cell")(
+		"iterations", boost::program_options::value<int>()->default_value(1),
+		"run the alltoall that many times through one persistent handle")(
+		"calibrate", "measure the transport and write the tuning file")(
+		"tuning",
+		boost::program_options::value<string>()->default_value(TUNING_FILE),
+		"tuning file")(
+		"addrs", boost::program_options::value<string>(),
+		"\"ip0:rank0 ip1:rank1 ..\", ranks with the same ip share a node")(
+		"stats", boost::program_options::value<string>(),
+		"write the time spent per step as JSON to this file at exit");
+
+	boost::program_options::variables_map vm;
+	boost::program_options::store(
+		boost::program_options::parse_command_line(argc, argv, desc), vm);
+	boost::program_options::notify(vm);
+
+	if (vm.count("rank"))
+		myrank = vm["rank"].as<int>();
+	else {
+		cerr << "the --rank argument is required" << endl;
+		return -1;
+	}
+
+	if (vm.count("num_procs"))
+		num_procs = vm["num_procs"].as<int>();
+	else {
+		cerr << "the --num_procs argument is required" << endl;
+		return -1;
+	}
+
+	tuning_file = vm["tuning"].as<string>();
+	iterations = vm["iterations"].as<int>();
+
+	if (vm.count("addrs"))
+		nodes = new node_map(
+			node_map_from_addrs(vm["addrs"].as<string>(), num_procs));
+
+	comm = open_rings(num_procs);
+
+	if (vm.count("calibrate")) {
+		struct alltoall_tuning t = alltoall_calibrate(myrank, num_procs);
+
+		for (auto &p : t.points)
+			cout << p.first << " bytes: " << p.second << " us" << endl;
+		cout << "alpha " << t.alpha << " us, beta " << t.beta
+			 << " us/byte, gamma " << t.gamma << " us/byte" << endl;
+
+		if (!save_tuning(tuning_file, t)) {
+			cerr << "could not write " << tuning_file << ": "
+				 << strerror(errno) << endl;
+			return -1;
+		}
+
+		close_rings(comm);
+		return 0;
+	}
+
+	if (vm.count("entries_per_cell"))
+		entries_per_cell = vm["entries_per_cell"].as<int>();
+	else {
+		cerr << "the --entries_per_cell argument is required" << endl;
+		return -1;
+	}
+
+	if (!load_tuning(tuning_file))
+		cerr << "no tuning in " << tuning_file << ", using the defaults"
+			 << endl;
+
+	rbuf = (int *)malloc(sizeof(int) * entries_per_cell * num_procs);
+	if (!rbuf) {
+		cerr << "malloc failed: " << strerror(errno) << endl;
+		return -1;
+	}
+
+	sbuf = (int *)malloc(sizeof(int) * entries_per_cell * num_procs);
+	if (!sbuf) {
+		cerr << "malloc failed: " << strerror(errno) << endl;
+		return -1;
+	}
+
+	for (int i = 0; i < entries_per_cell * num_procs; i++) sbuf[i] = myrank;
+
+	choice = alltoall_select(tuning, num_procs,
+							 sizeof(int) * (size_t)entries_per_cell, nodes);
+	std::cout << "Algorithm: " << algo_name(choice.algo) << " radix "
+			  << choice.radix << ", predicted " << choice.cost << " us"
+			  << std::endl;
+
+	std::cout << "Initial data: ";
+	for (int i = 0; i < entries_per_cell * num_procs; i++)
+		std::cout << sbuf[i] << " ";
+	std::cout << std::endl;
+
+	if (iterations > 1) {
+		// set up once, then only start and wait
+		alltoall_init(sbuf, entries_per_cell, rbuf, myrank, num_procs,
+					  sizeof(int), &handle);
+		for (int i = 0; i < iterations; i++) {
+			alltoall_start(&handle);
+			alltoall_wait(&handle);
+		}
+		alltoall_free(&handle);
+	} else {
+		alltoall(sbuf, entries_per_cell, rbuf, myrank, num_procs, sizeof(int));
+	}
+
+	std::cout << "Final data: ";
+	for (int i = 0; i < entries_per_cell * num_procs; i++)
+		std::cout << rbuf[i] << " ";
+	std::cout << std::endl;
+
+	close_rings(comm);
+
+	if (vm.count("stats") && !steps_save(vm["stats"].as<string>())) {
+		cerr << "could not write " << vm["stats"].as<string>() << endl;
+		return -1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,516 @@
+#ifndef ALLTOALL_H
+#define ALLTOALL_H
+
+#include <math.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "block_copy.h"
+#include "bruck.h"
+#include "comm.h"
+#include "hier.h"
+#include "pairwise.h"
+
+// alltoall front end that picks the algorithm from a cost model. A message of
+// n bytes costs alpha + beta * n, copying n bytes locally costs gamma * n.
+// The three are measured on the live transport by alltoall_calibrate and
+// kept in a tuning file that every rank loads.
+//
+// The candidates are pairwise and radix k bruck for the powers of two k up to
+// sqrt(P) and sqrt(P); radix 2 is the classic bruck, the others trade steps
+// for messages and are the hybrids of the two. With a node map the two level
+// alltoall of hier.h is a candidate too.
+
+#define TUNING_FILE "tuning.txt"
+
+#define ALGO_PAIRWISE 0
+#define ALGO_BRUCK 1
+#define ALGO_HYBRID 2
+#define ALGO_HIER 3
+
+struct alltoall_tuning {
+	// microseconds per message, per byte sent and per byte copied
+	double alpha;
+	double beta;
+	double gamma;
+	// what calibration measured: message size and microseconds
+	std::vector<std::pair<size_t, double>> points;
+};
+
+// until a calibration ran: 20us per message, 1GB/s links, 10GB/s copies
+struct alltoall_tuning tuning = {20, 1e-3, 1e-4, {}};
+// which ranks share a node, null if unknown
+struct node_map *nodes;
+
+struct alltoall_choice {
+	int algo;
+	int radix;
+	double cost;
+};
+
+double cost_pairwise(const struct alltoall_tuning &t, int num_procs,
+					 size_t cell) {
+	return (num_procs - 1) * (t.alpha + t.beta * cell);
+}
+
+// every step sends the cells with digit d in one message, packing and
+// unpacking them costs two copies; the cells are moved once at the start.
+// The j < P with digit d at weight pos come in runs of pos, one run in
+// every pos * radix.
+double cost_bruck(const struct alltoall_tuning &t, int num_procs, size_t cell,
+				  int radix) {
+	double cost = t.gamma * cell * num_procs;
+
+	for (long pos = 1; pos < num_procs; pos *= radix) {
+		long period = pos * radix;
+		for (int d = 1; d < radix && d * pos < num_procs; d++) {
+			long cells = num_procs / period * pos +
+						 std::min(std::max(num_procs % period - d * pos, 0l),
+								  pos);
+			cost += t.alpha + (t.beta + 2 * t.gamma) * cells * cell;
+		}
+	}
+	return cost;
+}
+
+// the leader of the widest node sends N - 1 messages of up to L * L cells;
+// the cells go through shared memory twice and are copied about four times.
+// The messages inside a node are not counted, for any of the candidates.
+double cost_hier(const struct alltoall_tuning &t, const struct node_map &m,
+				 size_t cell) {
+	int num_procs = m.node_of.size();
+	int width = node_map_width(m);
+
+	return (m.ranks.size() - 1) * (t.alpha + t.beta * width * width * cell) +
+		   6 * t.gamma * width * num_procs * cell;
+}
+
+// m, if given, is the node map of the ranks. The radixes tried are the
+// powers of two up to sqrt(P) and sqrt(P) itself, the two step hybrid; the
+// radixes above it only trade the second step for more messages.
+struct alltoall_choice alltoall_select(const struct alltoall_tuning &t,
+									   int num_procs, size_t cell,
+									   const struct node_map *m = nullptr) {
+	struct alltoall_choice best = {ALGO_PAIRWISE, num_procs,
+								   cost_pairwise(t, num_procs, cell)};
+	int root = ceil(sqrt(num_procs));
+	std::vector<int> radixes;
+
+	for (int radix = 2; radix <= root; radix *= 2) radixes.push_back(radix);
+	if (root > 2 && (root & (root - 1))) radixes.push_back(root);
+
+	for (int radix : radixes) {
+		if (radix >= num_procs) break;
+		double cost = cost_bruck(t, num_procs, cell, radix);
+		if (cost < best.cost)
+			best = {radix == 2 ? ALGO_BRUCK : ALGO_HYBRID, radix, cost};
+	}
+
+	// one rank per node is pairwise with extra copies
+	if (m && node_map_width(*m) > 1) {
+		double cost = cost_hier(t, *m, cell);
+		if (cost < best.cost) best = {ALGO_HIER, (int)m->ranks.size(), cost};
+	}
+	return best;
+}
+
+const char *algo_name(int algo) {
+	switch (algo) {
+	case ALGO_PAIRWISE:
+		return "pairwise";
+	case ALGO_BRUCK:
+		return "bruck";
+	case ALGO_HIER:
+		return "hier";
+	default:
+		return "hybrid";
+	}
+}
+
+// the choice of the last alltoall, made again only when the ranks, the
+// cell size, the node map or the tuning change; per thread, the ranks of
+// bench --loopback are threads. It starts out for 0 ranks, which no call
+// has.
+struct alltoall_cached {
+	int num_procs;
+	size_t cell;
+	const struct node_map *m;
+	double alpha, beta, gamma;
+	struct alltoall_choice choice;
+};
+
+thread_local struct alltoall_cached last_choice;
+
+// every rank has to load the same tuning, the choice is made locally
+int alltoall(const void *sendbuf, const int entries_per_cell, void *recvbuf,
+			 int rank, int num_procs, int bytes_per_entry) {
+	size_t cell = (size_t)entries_per_cell * bytes_per_entry;
+	struct alltoall_cached &l = last_choice;
+
+	if (l.num_procs != num_procs || l.cell != cell || l.m != nodes ||
+		l.alpha != tuning.alpha || l.beta != tuning.beta ||
+		l.gamma != tuning.gamma)
+		l = {num_procs, cell, nodes, tuning.alpha, tuning.beta, tuning.gamma,
+			 alltoall_select(tuning, num_procs, cell, nodes)};
+	struct alltoall_choice c = l.choice;
+
+	if (c.algo == ALGO_HIER)
+		return alltoall_hier(sendbuf, entries_per_cell, recvbuf, rank,
+							 num_procs, bytes_per_entry, *nodes);
+	if (c.algo == ALGO_PAIRWISE)
+		return alltoall_pairwise_nb(sendbuf, entries_per_cell, recvbuf, rank,
+									num_procs, bytes_per_entry, 0);
+	return alltoall_bruck_radix(sendbuf, entries_per_cell, recvbuf, rank,
+								num_procs, bytes_per_entry, c.radix);
+}
+
+// Persistent alltoall, in the spirit of MPI_Alltoall_init: alltoall_init
+// picks the algorithm and works out its schedule and buffers once, after
+// which alltoall_start / alltoall_wait run it as often as needed on the same
+// sendbuf and recvbuf with no setup per call. The connections are set up once
+// anyway, the rdma process keeps them for as long as the rings are open.
+// alltoall_test makes progress without blocking, so the caller can compute
+// between start and wait.
+
+// one message of the schedule: the cells at offs of recvbuf go to
+// write_proc, the ones from read_proc land at the same offsets
+struct alltoall_msg {
+	int write_proc, read_proc;
+	std::vector<size_t> offs;
+};
+
+struct alltoall_handle {
+	const char *sendbuf;
+	char *recvbuf;
+	size_t cell;
+	int rank, num_procs;
+	struct alltoall_choice choice;
+
+	// bruck: the messages in order and the pack / unpack buffers
+	std::vector<struct alltoall_msg> msgs;
+	std::vector<char> contig, tmp;
+	size_t cur, len;
+
+	// both: bytes moved of the current message, or per peer for pairwise
+	std::vector<size_t> sent, recvd;
+	// pairwise: the exchanges counted in num_done
+	std::vector<bool> done;
+	int num_done;
+	bool active;
+	// whether the last alltoall_test moved anything
+	bool progress;
+};
+
+void alltoall_init(const void *sendbuf, const int entries_per_cell,
+				   void *recvbuf, int rank, int num_procs, int bytes_per_entry,
+				   struct alltoall_handle *h) {
+	h->sendbuf = (const char *)sendbuf;
+	h->recvbuf = (char *)recvbuf;
+	h->cell = (size_t)entries_per_cell * bytes_per_entry;
+	h->rank = rank;
+	h->num_procs = num_procs;
+	// the two level alltoall has no persistent schedule
+	h->choice = alltoall_select(tuning, num_procs, h->cell);
+	h->msgs.clear();
+	h->active = false;
+
+	if (h->choice.algo == ALGO_PAIRWISE) {
+		h->sent.assign(num_procs, 0);
+		h->recvd.assign(num_procs, 0);
+		h->done.assign(num_procs, false);
+		return;
+	}
+
+	// the schedule of alltoall_bruck_radix, with the cell at index j kept
+	// at (rank - j) mod P of recvbuf
+	int radix = h->choice.radix;
+	size_t most = 0;
+
+	for (int pos = 1; pos < num_procs; pos *= radix) {
+		for (int d = 1; d < radix && d * pos < num_procs; d++) {
+			struct alltoall_msg m;
+			m.write_proc = (rank + d * pos) % num_procs;
+			m.read_proc = (rank - d * pos + num_procs) % num_procs;
+			for (int j = d * pos; j < num_procs; j++)
+				if (j / pos % radix == d)
+					m.offs.push_back((rank - j + num_procs) % num_procs *
+									 h->cell);
+			most = std::max(most, m.offs.size());
+			h->msgs.push_back(m);
+		}
+		if (pos > num_procs / radix) break;
+	}
+
+	h->contig.resize(most * h->cell);
+	h->tmp.resize(most * h->cell);
+	h->sent.assign(1, 0);
+	h->recvd.assign(1, 0);
+}
+
+void alltoall_pack(struct alltoall_handle *h) {
+	struct alltoall_msg &m = h->msgs[h->cur];
+
+	for (size_t k = 0; k < m.offs.size(); k++)
+		block_copy(h->contig.data() + k * h->cell, h->recvbuf + m.offs[k],
+				   h->cell);
+	h->len = m.offs.size() * h->cell;
+	h->sent[0] = h->recvd[0] = 0;
+	step_lap(STEP_PACK);
+}
+
+void alltoall_start(struct alltoall_handle *h) {
+	int rank = h->rank, num_procs = h->num_procs;
+
+	h->active = true;
+	h->num_done = 0;
+
+	// the wire time of a step runs until the alltoall_test that completed
+	// it, it includes what the caller did in between
+	step_begin();
+
+	if (h->choice.algo == ALGO_PAIRWISE) {
+		memcpy(h->recvbuf + rank * h->cell, h->sendbuf + rank * h->cell,
+			   h->cell);
+		step_lap(STEP_LOCAL);
+		std::fill(h->sent.begin(), h->sent.end(), 0);
+		std::fill(h->recvd.begin(), h->recvd.end(), 0);
+		std::fill(h->done.begin(), h->done.end(), false);
+		return;
+	}
+
+	for (int j = 0; j < num_procs; j++) {
+		int dst = (rank - j + num_procs) % num_procs;
+		int src = (rank + j) % num_procs;
+		block_copy(h->recvbuf + dst * h->cell, h->sendbuf + src * h->cell,
+				   h->cell);
+	}
+	step_lap(STEP_LOCAL);
+
+	h->cur = 0;
+	if (h->msgs.empty())
+		h->active = false;
+	else
+		alltoall_pack(h);
+}
+
+// moves what it can without blocking, true once the alltoall is complete
+bool alltoall_test(struct alltoall_handle *h) {
+	ssize_t ret;
+
+	h->progress = false;
+	if (!h->active) return true;
+
+	if (h->choice.algo == ALGO_PAIRWISE) {
+		// every exchange in flight at once, like alltoall_pairwise_nb
+		for (int i = 1; i < h->num_procs; i++) {
+			int write_proc = (h->rank + i) % h->num_procs;
+			int read_proc = (h->rank - i + h->num_procs) % h->num_procs;
+
+			if (h->done[i]) continue;
+
+			size_t n = rtry_write(
+				write_proc, h->sendbuf + write_proc * h->cell + h->sent[i],
+				h->cell - h->sent[i]);
+			h->sent[i] += n;
+			if (n > 0 && h->sent[i] == h->cell) rflush(write_proc);
+
+			ret = rtry_read(read_proc,
+							h->recvbuf + read_proc * h->cell + h->recvd[i],
+							h->cell - h->recvd[i]);
+			if (ret < 0) {
+				std::cerr << "rtry_read failed: " << strerror(errno)
+						  << std::endl;
+				exit(-1);
+			}
+			h->recvd[i] += ret;
+			h->progress |= n > 0 || ret > 0;
+
+			// empty cells included, they are done at the first pass
+			if (h->sent[i] == h->cell && h->recvd[i] == h->cell) {
+				h->done[i] = true;
+				h->num_done++;
+			}
+		}
+
+		h->active = h->num_done < h->num_procs - 1;
+		if (!h->active) step_lap(STEP_WIRE, h->cell * (h->num_procs - 1));
+		return !h->active;
+	}
+
+	// the bruck messages depend on each other, one at a time
+	while (h->active) {
+		struct alltoall_msg &m = h->msgs[h->cur];
+		size_t n;
+
+		n = rtry_write(m.write_proc, h->contig.data() + h->sent[0],
+					   h->len - h->sent[0]);
+		h->sent[0] += n;
+		if (n > 0 && h->sent[0] == h->len) rflush(m.write_proc);
+
+		ret = rtry_read(m.read_proc, h->tmp.data() + h->recvd[0],
+						h->len - h->recvd[0]);
+		if (ret < 0) {
+			std::cerr << "rtry_read failed: " << strerror(errno) << std::endl;
+			exit(-1);
+		}
+		h->recvd[0] += ret;
+		h->progress |= n > 0 || ret > 0;
+
+		if (h->sent[0] < h->len || h->recvd[0] < h->len) break;
+		step_lap(STEP_WIRE, h->len);
+
+		for (size_t k = 0; k < m.offs.size(); k++)
+			block_copy(h->recvbuf + m.offs[k], h->tmp.data() + k * h->cell,
+					   h->cell);
+		step_lap(STEP_UNPACK);
+		step_next();
+
+		if (++h->cur == h->msgs.size())
+			h->active = false;
+		else
+			alltoall_pack(h);
+	}
+
+	return !h->active;
+}
+
+void alltoall_wait(struct alltoall_handle *h) {
+	unsigned spins = 0;
+
+	while (!alltoall_test(h)) {
+		if (h->progress)
+			spins = 0;
+		else
+			ring_relax(spins);
+	}
+}
+
+void alltoall_free(struct alltoall_handle *h) {
+	h->msgs.clear();
+	h->contig = std::vector<char>();
+	h->tmp = std::vector<char>();
+	h->sent.clear();
+	h->recvd.clear();
+}
+
+// returns false if the file can not be read, tuning is left untouched then
+bool load_tuning(const std::string &path) {
+	std::ifstream in(path);
+	std::string line, key;
+	struct alltoall_tuning t = {};
+	int found = 0;
+
+	if (!in) return false;
+
+	while (getline(in, line)) {
+		std::istringstream iss(line);
+		if (!(iss >> key) || key[0] == '#') continue;
+
+		if (key == "alpha" && iss >> t.alpha) found |= 1;
+		if (key == "beta" && iss >> t.beta) found |= 2;
+		if (key == "gamma" && iss >> t.gamma) found |= 4;
+		if (key == "point") {
+			size_t size;
+			double us;
+			if (iss >> size >> us) t.points.push_back({size, us});
+		}
+	}
+
+	if (found != 7) return false;
+	tuning = t;
+	return true;
+}
+
+bool save_tuning(const std::string &path, const struct alltoall_tuning &t) {
+	std::ofstream out(path);
+	if (!out) return false;
+
+	out << "# written by alltoall --calibrate, times in microseconds"
+		<< std::endl;
+	out << "alpha " << t.alpha << std::endl;
+	out << "beta " << t.beta << std::endl;
+	out << "gamma " << t.gamma << std::endl;
+	for (auto &p : t.points)
+		out << "point " << p.first << " " << p.second << std::endl;
+	return (bool)out;
+}
+
+// everyone waits for everyone, an alltoall of one byte
+void alltoall_barrier(int rank, int num_procs) {
+	std::vector<char> s(num_procs), r(num_procs);
+	alltoall_pairwise_nb(s.data(), 1, r.data(), rank, num_procs, 1, 0);
+}
+
+// Measures alpha and beta with exchanges between ring neighbours, every rank
+// sending to rank + 1 and receiving from rank - 1 at the same time, at sizes
+// from 8 bytes to 512KB, taking the median time of every size. alpha is the
+// time of the smallest exchange, beta the slope up to the largest one. gamma
+// is the time of a large block_copy. The ranks average
+// what they measured, so they all end up with the same tuning.
+struct alltoall_tuning alltoall_calibrate(int rank, int num_procs) {
+	struct alltoall_tuning t = {};
+	int write_proc = (rank + 1) % num_procs;
+	int read_proc = (rank - 1 + num_procs) % num_procs;
+	std::vector<char> sbuf(1 << 20), rbuf(1 << 20);
+
+	// a single rank has nobody to exchange with, nothing costs anything and
+	// the selection falls on pairwise, which only copies the own cell
+	if (num_procs == 1) return t;
+
+	for (size_t size = 8; size <= sbuf.size(); size *= 4) {
+		int iters = size < (64 << 10) ? 50 : 10;
+		std::vector<double> times;
+
+		alltoall_barrier(rank, num_procs);
+		for (int i = 0; i < iters; i++) {
+			double start = stat_now_us();
+			rsendrecv(write_proc, sbuf.data(), size, read_proc, rbuf.data(),
+					  size);
+			times.push_back(stat_now_us() - start);
+		}
+
+		std::sort(times.begin(), times.end());
+		t.points.push_back({size, times[iters / 2]});
+	}
+
+	// the smallest exchange is all latency, the largest mostly bandwidth
+	auto &lo = t.points.front(), &hi = t.points.back();
+	t.alpha = lo.second;
+	t.beta = std::max(hi.second - lo.second, 0.0) / (hi.first - lo.first);
+
+	{
+		std::vector<char> src(8 << 20, 1), dst(8 << 20);
+		double start = stat_now_us();
+		for (int i = 0; i < 4; i++)
+			block_copy(dst.data(), src.data(), src.size());
+		t.gamma = (stat_now_us() - start) / (4.0 * src.size());
+	}
+
+	// average alpha, beta and gamma over the ranks
+	{
+		double mine[3] = {t.alpha, t.beta, t.gamma};
+		std::vector<double> all(3 * num_procs), out(3 * num_procs);
+		for (int i = 0; i < num_procs; i++)
+			memcpy(&all[3 * i], mine, sizeof(mine));
+
+		alltoall_pairwise_nb(all.data(), 3, out.data(), rank, num_procs,
+							 sizeof(double), 0);
+
+		t.alpha = t.beta = t.gamma = 0;
+		for (int i = 0; i < num_procs; i++) {
+			t.alpha += out[3 * i] / num_procs;
+			t.beta += out[3 * i + 1] / num_procs;
+			t.gamma += out[3 * i + 2] / num_procs;
+		}
+	}
+
+	return t;
+}
+
+#endif
@@ -0,0 +1,322 @@
+#include <fcntl.h>
+#include <math.h>
+
+#include <algorithm>
+#include <boost/program_options.hpp>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "alltoall.h"
+#include "loopback.h"
+#include "progress.h"
+
+using namespace std;
+
+// Latency and bandwidth of the alltoall algorithms, in the spirit of
+// osu_alltoall: for every cell size from --min_size to --max_size bytes the
+// chosen algorithm runs --warmup times and then --iters times, each run
+// starting after a barrier. The time of a run is the time of the slowest
+// rank, rank 0 prints min / avg / p50 / p99 / max of those and the aggregate
+// bandwidth, P * (P - 1) * size bytes over the average time, as CSV or JSON.
+//
+// With --loopback all the ranks are threads of this process, talking through
+// in-memory rings instead of the rdma processes. --addrs tells which ranks
+// share a node, for --algo hier and auto. --algo progress runs the pairwise
+// exchanges on the progress engine of progress.h, optionally pinned to
+// --progress_cpu.
+
+struct bench_result {
+	size_t size;
+	int iters;
+	double min, avg, p50, p99, max;
+	double bw;
+};
+
+string algo, format;
+// the handle of --algo persistent, set up once per size
+thread_local struct alltoall_handle *handle;
+// the engine of --algo progress, one per rank
+thread_local struct progress *engine;
+int radix, window, progress_cpu;
+size_t segment;
+size_t min_size, max_size, large_size;
+int iters, iters_large, warmup;
+
+void run(const char *sbuf, size_t size, char *rbuf, int num_procs) {
+	if (algo == "pairwise")
+		alltoall_pairwise(sbuf, size, rbuf, myrank, num_procs, 1);
+	else if (algo == "pairwise_nb")
+		alltoall_pairwise_nb(sbuf, size, rbuf, myrank, num_procs, 1, window);
+	else if (algo == "bruck")
+		alltoall_bruck(sbuf, size, rbuf, myrank, num_procs, 1);
+	else if (algo == "radix")
+		alltoall_bruck_radix(sbuf, size, rbuf, myrank, num_procs, 1, radix);
+	else if (algo == "pipelined")
+		alltoall_bruck_pipelined(sbuf, size, rbuf, myrank, num_procs, 1, radix,
+								 segment);
+	else if (algo == "hier")
+		alltoall_hier(sbuf, size, rbuf, myrank, num_procs, 1, *nodes);
+	else if (algo == "progress")
+		alltoall_progress(engine, sbuf, size, rbuf, myrank, num_procs, 1);
+	else if (algo == "persistent") {
+		alltoall_start(handle);
+		alltoall_wait(handle);
+	} else
+		alltoall(sbuf, size, rbuf, myrank, num_procs, 1);
+}
+
+// every byte names the rank it came from, the one it goes to and its place
+// in the cell, so shifted or reordered bytes show too
+char pattern(int from, int to, size_t b) {
+	return (char)(from * 31 + to * 7 + b * 13 + 1);
+}
+
+bool check(const char *rbuf, size_t size, int num_procs) {
+	for (int i = 0; i < num_procs; i++)
+		for (size_t b = 0; b < size; b++)
+			if (rbuf[i * size + b] != pattern(i, myrank, b)) return false;
+	return true;
+}
+
+double percentile(const vector<double> &sorted, double p) {
+	size_t i = (size_t)ceil(p / 100 * sorted.size());
+	return sorted[min(max(i, (size_t)1), sorted.size()) - 1];
+}
+
+// the benchmark as seen by one rank, rank 0 prints the results
+void bench(int num_procs) {
+	vector<struct bench_result> results;
+
+	vector<char> sbuf(max_size * num_procs), rbuf(max_size * num_procs);
+
+	if (algo == "progress") engine = progress_start(comm, progress_cpu);
+
+	for (size_t size = min_size; size <= max_size; size *= 2) {
+		int n = size < large_size ? iters : iters_large;
+		vector<double> times(n), all(n * num_procs), slowest(n);
+
+		for (int i = 0; i < num_procs; i++)
+			for (size_t b = 0; b < size; b++)
+				sbuf[i * size + b] = pattern(myrank, i, b);
+
+		struct alltoall_handle h;
+		if (algo == "persistent") {
+			alltoall_init(sbuf.data(), size, rbuf.data(), myrank, num_procs,
+						  1, &h);
+			handle = &h;
+		}
+
+		for (int i = 0; i < warmup; i++)
+			run(sbuf.data(), size, rbuf.data(), num_procs);
+
+		if (warmup && !check(rbuf.data(), size, num_procs)) {
+			cerr << "[" << myrank << "] wrong data with " << size
+				 << " byte cells" << endl;
+			exit(-1);
+		}
+
+		for (int i = 0; i < n; i++) {
+			alltoall_barrier(myrank, num_procs);
+			double start = stat_now_us();
+			run(sbuf.data(), size, rbuf.data(), num_procs);
+			times[i] = stat_now_us() - start;
+		}
+
+		if (algo == "persistent") alltoall_free(&h);
+
+		// a run takes as long as its slowest rank
+		{
+			vector<double> mine(n * num_procs);
+			for (int i = 0; i < num_procs; i++)
+				copy(times.begin(), times.end(), mine.begin() + i * n);
+			alltoall_pairwise_nb(mine.data(), n, all.data(), myrank, num_procs,
+								 sizeof(double), 0);
+		}
+
+		for (int i = 0; i < n; i++) {
+			slowest[i] = 0;
+			for (int r = 0; r < num_procs; r++)
+				slowest[i] = max(slowest[i], all[r * n + i]);
+		}
+		sort(slowest.begin(), slowest.end());
+
+		struct bench_result res = {};
+		res.size = size;
+		res.iters = n;
+		res.min = slowest.front();
+		res.max = slowest.back();
+		res.avg = 0;
+		for (auto t : slowest) res.avg += t / n;
+		res.p50 = percentile(slowest, 50);
+		res.p99 = percentile(slowest, 99);
+		// bytes per microsecond is MB/s
+		res.bw = (double)num_procs * (num_procs - 1) * size / res.avg;
+		results.push_back(res);
+
+		if (size > max_size / 2) break;
+	}
+
+	if (algo == "progress") progress_stop(engine);
+
+	if (myrank == 0) {
+		ostringstream out;
+
+		if (format == "json") {
+			out << "[" << endl;
+			for (size_t i = 0; i < results.size(); i++) {
+				auto &r = results[i];
+				out << "  {\"algo\": \"" << algo
+					<< "\", \"procs\": " << num_procs
+					<< ", \"size\": " << r.size << ", \"iters\": " << r.iters
+					<< ", \"min_us\": " << r.min << ", \"avg_us\": " << r.avg
+					<< ", \"p50_us\": " << r.p50 << ", \"p99_us\": " << r.p99
+					<< ", \"max_us\": " << r.max << ", \"bw_MBps\": " << r.bw
+					<< "}" << (i + 1 < results.size() ? "," : "") << endl;
+			}
+			out << "]" << endl;
+		} else {
+			out << "algo,procs,size,iters,min_us,avg_us,p50_us,p99_us,max_us,"
+				   "bw_MBps"
+				<< endl;
+			for (auto &r : results)
+				out << algo << "," << num_procs << "," << r.size << ","
+					<< r.iters << "," << r.min << "," << r.avg << "," << r.p50
+					<< "," << r.p99 << "," << r.max << "," << r.bw << endl;
+		}
+		cout << out.str();
+	}
+}
+
+int main(int argc, char *argv[]) {
+	int num_procs;
+	bool loopback;
+
+	boost::program_options::options_description desc("Allowed options");
+	desc.add_options()("help", "show possible options")(
+		"rank", boost::program_options::value<int>(), "rank")(
+		"num_procs", boost::program_options::value<int>(), "num_procs")(
+		"algo", boost::program_options::value<string>()->default_value("auto"),
+		"pairwise, pairwise_nb, bruck, radix, pipelined, hier, auto, "
+		"persistent or progress")(
+		"radix", boost::program_options::value<int>()->default_value(2),
+		"radix of --algo radix and pipelined")(
+		"segment",
+		boost::program_options::value<size_t>()->default_value(64 << 10),
+		"bytes per segment of --algo pipelined")(
+		"window", boost::program_options::value<int>()->default_value(0),
+		"exchanges in flight with --algo pairwise_nb, 0 for all")(
+		"progress_cpu", boost::program_options::value<int>()->default_value(-1),
+		"cpu the progress thread of --algo progress runs on, -1 for any")(
+		"min_size", boost::program_options::value<size_t>()->default_value(1),
+		"smallest cell, in bytes")(
+		"max_size",
+		boost::program_options::value<size_t>()->default_value(1 << 20),
+		"largest cell, in bytes")(
+		"iters", boost::program_options::value<int>()->default_value(1000),
+		"timed runs per size")(
+		"iters_large", boost::program_options::value<int>()->default_value(100),
+		"timed runs per size from --large_size on")(
+		"large_size",
+		boost::program_options::value<size_t>()->default_value(8192),
+		"cell size from which --iters_large applies")(
+		"warmup", boost::program_options::value<int>()->default_value(10),
+		"untimed runs per size")(
+		"format", boost::program_options::value<string>()->default_value("csv"),
+		"csv or json")(
+		"tuning",
+		boost::program_options::value<string>()->default_value(TUNING_FILE),
+		"tuning file of --algo auto and persistent")(
+		"loopback", "run all the ranks as threads of this process")(
+		"ring_size",
+		boost::program_options::value<size_t>()->default_value(
+			LOOPBACK_RING_SIZE),
+		"bytes per ring with --loopback")(
+		"addrs", boost::program_options::value<string>(),
+		"\"ip0:rank0 ip1:rank1 ..\", ranks with the same ip share a node");
+
+	boost::program_options::variables_map vm;
+	boost::program_options::store(
+		boost::program_options::parse_command_line(argc, argv, desc), vm);
+	boost::program_options::notify(vm);
+
+	if (vm.count("help")) {
+		cout << desc << endl;
+		return 0;
+	}
+
+	loopback = vm.count("loopback");
+
+	if (vm.count("rank"))
+		myrank = vm["rank"].as<int>();
+	else if (!loopback) {
+		cerr << "the --rank argument is required" << endl;
+		return -1;
+	}
+
+	if (vm.count("num_procs"))
+		num_procs = vm["num_procs"].as<int>();
+	else {
+		cerr << "the --num_procs argument is required" << endl;
+		return -1;
+	}
+
+	algo = vm["algo"].as<string>();
+	radix = vm["radix"].as<int>();
+	window = vm["window"].as<int>();
+	progress_cpu = vm["progress_cpu"].as<int>();
+	segment = vm["segment"].as<size_t>();
+	min_size = max(vm["min_size"].as<size_t>(), (size_t)1);
+	max_size = vm["max_size"].as<size_t>();
+	large_size = vm["large_size"].as<size_t>();
+	iters = vm["iters"].as<int>();
+	iters_large = vm["iters_large"].as<int>();
+	warmup = vm["warmup"].as<int>();
+	format = vm["format"].as<string>();
+
+	if (algo != "pairwise" && algo != "pairwise_nb" && algo != "bruck" &&
+		algo != "radix" && algo != "pipelined" && algo != "hier" &&
+		algo != "auto" && algo != "persistent" && algo != "progress") {
+		cerr << "unknown --algo " << algo << endl;
+		return -1;
+	}
+
+	if (vm.count("addrs"))
+		nodes = new node_map(
+			node_map_from_addrs(vm["addrs"].as<string>(), num_procs));
+	else if (algo == "hier") {
+		cerr << "--algo hier needs --addrs" << endl;
+		return -1;
+	}
+
+	if (radix < 2 || iters < 1 || iters_large < 1) {
+		cerr << "--radix must be at least 2, the iteration counts at least 1"
+			 << endl;
+		return -1;
+	}
+
+	if ((algo == "auto" || algo == "persistent") &&
+		!load_tuning(vm["tuning"].as<string>()) && myrank == 0)
+		cerr << "no tuning in " << vm["tuning"].as<string>()
+			 << ", using the defaults" << endl;
+
+	if (loopback && (vm["ring_size"].as<size_t>() % 8 ||
+					 vm["ring_size"].as<size_t>() < 4096)) {
+		cerr << "--ring_size must be a multiple of 8, at least 4096" << endl;
+		return -1;
+	}
+
+	if (loopback) {
+		loopback_run(num_procs, vm["ring_size"].as<size_t>(),
+					 [&](int) { bench(num_procs); });
+		return 0;
+	}
+
+	comm = open_rings(num_procs);
+	bench(num_procs);
+	close_rings(comm);
+
+	return 0;
+}
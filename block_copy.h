@@ -0,0 +1,80 @@
+#ifndef BLOCK_COPY_H
+#define BLOCK_COPY_H
+
+#include <cstdint>
+#include <cstring>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// Copy kernel for the pack / unpack steps of the algorithms. Small runs go
+// through memcpy; runs of at least BLOCK_COPY_NT bytes are written with
+// non-temporal stores, they are not read again before the next step and
+// would only evict the rest of the buffers from the cache.
+
+#define BLOCK_COPY_NT (256 << 10)
+
+inline void block_copy(void *dst, const void *src, size_t n) {
+#ifdef __SSE2__
+	if (n >= BLOCK_COPY_NT) {
+		char *d = (char *)dst;
+		const char *s = (const char *)src;
+		size_t head = -(uintptr_t)d & 15;
+
+		// align the destination, the source may stay unaligned
+		memcpy(d, s, head);
+		d += head;
+		s += head;
+		n -= head;
+
+		for (; n >= 64; n -= 64, d += 64, s += 64) {
+			__m128i a = _mm_loadu_si128((const __m128i *)s);
+			__m128i b = _mm_loadu_si128((const __m128i *)(s + 16));
+			__m128i c = _mm_loadu_si128((const __m128i *)(s + 32));
+			__m128i e = _mm_loadu_si128((const __m128i *)(s + 48));
+			_mm_stream_si128((__m128i *)d, a);
+			_mm_stream_si128((__m128i *)(d + 16), b);
+			_mm_stream_si128((__m128i *)(d + 32), c);
+			_mm_stream_si128((__m128i *)(d + 48), e);
+		}
+		memcpy(d, s, n);
+
+		// the streamed data has to be visible before it is sent
+		_mm_sfence();
+		return;
+	}
+#endif
+	memcpy(dst, src, n);
+}
+
+// An entry of N bytes at any address; copying one is a single load and
+// store of that width, whatever the alignment of the buffer.
+template <size_t N> struct entry {
+	char b[N];
+};
+
+// the widest entry, of 16, 8, 4, 2 or 1 bytes, that a cell of n bytes is
+// made of
+inline int entry_width(size_t n) {
+	int w = 16;
+	while (n % w) w /= 2;
+	return w;
+}
+
+// Copies n entries of type T. The width is known at compile time, so a
+// single entry is one move and a short run a few, not a call to memcpy;
+// longer runs go to block_copy. Single bytes are never moved one at a time,
+// a run of them is one memcpy.
+#define ENTRY_COPY_INLINE 128
+
+template <typename T>
+inline void entry_copy(T *dst, const T *src, size_t n) {
+	if (sizeof(T) == 1 || n * sizeof(T) >= ENTRY_COPY_INLINE) {
+		block_copy(dst, src, n * sizeof(T));
+		return;
+	}
+	for (size_t i = 0; i < n; i++) memcpy(dst + i, src + i, sizeof(T));
+}
+
+#endif
@@ -0,0 +1,174 @@
+#ifndef BOOTSTRAP_H
+#define BOOTSTRAP_H
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+
+// Startup rendezvous of the rdma processes. Instead of a TCP connection per
+// pair of ranks, rank 0 listens on one port and every other rank connects to
+// it once: it sends one block for every rank, what that rank needs to talk to
+// it, and gets back the block every rank had for it. Rank 0 answers once all
+// of them are in, so startup costs a single round trip per rank, whatever
+// the order the processes came up in.
+
+// how long a rank keeps trying to reach rank 0, and how often
+#define BOOTSTRAP_TIMEOUT_S 60
+#define BOOTSTRAP_RETRY_MS 10
+
+// what a rank sends ahead of its blocks
+struct bootstrap_hdr {
+	uint32_t rank;
+	uint32_t num_procs;
+	uint64_t size;
+};
+
+inline bool bootstrap_io(int fd, void *buff, size_t nbyte, bool out) {
+	char *cbuff = (char *)buff;
+	size_t done = 0;
+
+	while (done < nbyte) {
+		ssize_t res = out ? write(fd, cbuff + done, nbyte - done)
+						  : read(fd, cbuff + done, nbyte - done);
+		if (res == -1 && errno == EINTR) continue;
+		if (res <= 0) {
+			if (res == 0) errno = ECONNRESET;
+			return false;
+		}
+		done += res;
+	}
+	return true;
+}
+
+// rank 0: collects the blocks of every rank, then sends each rank its own
+inline int bootstrap_serve(int port, int num_procs, const char *send,
+						   size_t size, char *recv) {
+	std::vector<char> all((size_t)num_procs * num_procs * size);
+	std::vector<int> conns(num_procs, -1);
+	struct sockaddr_in addr;
+	int sockfd, one = 1, ret = -1;
+
+	// all[from][to] is the block rank "from" has for rank "to"
+	memcpy(&all[0], send, num_procs * size);
+
+	sockfd = socket(AF_INET, SOCK_STREAM, 0);
+	if (sockfd == -1) return -1;
+
+	setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_ANY);
+	addr.sin_port = htons(port);
+
+	if (bind(sockfd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+		listen(sockfd, num_procs) != 0)
+		goto out;
+
+	for (int i = 1; i < num_procs; i++) {
+		struct bootstrap_hdr hdr;
+		int connfd = accept(sockfd, NULL, NULL);
+		if (connfd == -1) goto out;
+
+		if (!bootstrap_io(connfd, &hdr, sizeof(hdr), false)) {
+			close(connfd);
+			goto out;
+		}
+
+		if (hdr.rank == 0 || hdr.rank >= (uint32_t)num_procs ||
+			conns[hdr.rank] != -1 || hdr.num_procs != (uint32_t)num_procs ||
+			hdr.size != size) {
+			close(connfd);
+			errno = EPROTO;
+			goto out;
+		}
+		conns[hdr.rank] = connfd;
+
+		if (!bootstrap_io(connfd, &all[hdr.rank * num_procs * size],
+						  num_procs * size, false))
+			goto out;
+	}
+
+	for (int to = 0; to < num_procs; to++) {
+		std::vector<char> col(num_procs * size);
+		for (int from = 0; from < num_procs; from++)
+			memcpy(&col[from * size], &all[(from * num_procs + to) * size],
+				   size);
+
+		if (to == 0)
+			memcpy(recv, col.data(), col.size());
+		else if (!bootstrap_io(conns[to], col.data(), col.size(), true))
+			goto out;
+	}
+	ret = 0;
+
+out:
+	for (auto c : conns)
+		if (c != -1) close(c);
+	close(sockfd);
+	return ret;
+}
+
+// every other rank: connects to rank 0, retrying until it listens
+inline int bootstrap_join(const std::string &ip, int port, int rank,
+						  int num_procs, const char *send, size_t size,
+						  char *recv) {
+	struct bootstrap_hdr hdr = {(uint32_t)rank, (uint32_t)num_procs, size};
+	struct timespec retry = {0, BOOTSTRAP_RETRY_MS * 1000000L};
+	struct sockaddr_in addr;
+	int sockfd = -1, tries;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = inet_addr(ip.c_str());
+	addr.sin_port = htons(port);
+
+	for (tries = BOOTSTRAP_TIMEOUT_S * 1000 / BOOTSTRAP_RETRY_MS; tries > 0;
+		 tries--) {
+		sockfd = socket(AF_INET, SOCK_STREAM, 0);
+		if (sockfd == -1) return -1;
+
+		if (connect(sockfd, (struct sockaddr *)&addr, sizeof(addr)) == 0)
+			break;
+
+		close(sockfd);
+		if (errno != ECONNREFUSED && errno != ETIMEDOUT &&
+			errno != EHOSTUNREACH)
+			return -1;
+		nanosleep(&retry, nullptr);
+	}
+	if (tries == 0) return -1;
+
+	if (!bootstrap_io(sockfd, &hdr, sizeof(hdr), true) ||
+		!bootstrap_io(sockfd, (void *)send, num_procs * size, true) ||
+		!bootstrap_io(sockfd, recv, num_procs * size, false)) {
+		close(sockfd);
+		return -1;
+	}
+
+	close(sockfd);
+	return 0;
+}
+
+// send holds num_procs blocks of size bytes, block i for rank i; recv gets
+// the block of every rank for us, in rank order. ip and port are the ones of
+// rank 0. Returns 0, or -1 with errno set.
+inline int bootstrap_exchange(const std::string &ip, int port, int rank,
+							  int num_procs, const void *send, size_t size,
+							  void *recv) {
+	if (rank == 0)
+		return bootstrap_serve(port, num_procs, (const char *)send, size,
+							   (char *)recv);
+	return bootstrap_join(ip, port, rank, num_procs, (const char *)send,
+						  size, (char *)recv);
+}
+
+#endif
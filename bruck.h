@@ -0,0 +1,495 @@
+#ifndef BRUCK_H
+#define BRUCK_H
+
+#include <math.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <vector>
+
+#include "block_copy.h"
+#include "comm.h"
+
+void rotate(void *recvbuf, int new_first_byte, int last_byte) {
+	char *recv_buffer = (char *)(recvbuf);
+	std::rotate(recv_buffer, &(recv_buffer[new_first_byte]),
+				&(recv_buffer[last_byte]));
+}
+
+// Bruck without moving the whole buffer around: the cell that the rotated
+// algorithm keeps at index j is kept at (rank - j) mod num_procs of
+// recvbuf instead. That is where the cell arriving from rank - j belongs, so
+// once the steps are done every cell is already in its final place and both
+// rotations and the reversal disappear.
+//
+// The steps go over the digits of j in base radix: at the step of digit
+// weight pos, the cells whose digit is d go to rank + d * pos, for every d in
+// 1 .. radix - 1. That is ceil(log_radix(P)) steps of radix - 1 messages
+// each, and it works for any P.
+//
+// The buffers hold entries_per_cell entries of type T per cell: offsets are
+// counted in entries and the cells are copied with entry_copy, at the width
+// of T.
+template <typename T>
+int alltoall_bruck_entries(const T *sendbuf, const int entries_per_cell,
+						   T *recvbuf, int rank, int num_procs, int radix) {
+	T *recv_buffer = recvbuf;
+	const T *send_buffer = sendbuf;
+	size_t msg_size = entries_per_cell;
+	int write_proc, read_proc;
+	size_t ctr;
+
+	T *contig_buf = (T *)malloc(sizeof(T) * msg_size * num_procs);
+	T *tmpbuf = (T *)malloc(sizeof(T) * msg_size * num_procs);
+
+	step_begin();
+
+	// the permutation can not be done in place
+	if (sendbuf == recvbuf) {
+		memcpy(tmpbuf, sendbuf, sizeof(T) * msg_size * num_procs);
+		send_buffer = tmpbuf;
+	}
+
+	for (int j = 0; j < num_procs; j++) {
+		int dst = (rank - j + num_procs) % num_procs;
+		int src = (rank + j) % num_procs;
+		entry_copy(recv_buffer + dst * msg_size, send_buffer + src * msg_size,
+				   msg_size);
+	}
+	step_lap(STEP_LOCAL);
+
+	for (int pos = 1; pos < num_procs; pos *= radix) {
+		for (int d = 1; d < radix && d * pos < num_procs; d++) {
+			read_proc = (rank - d * pos + num_procs) % num_procs;
+			write_proc = (rank + d * pos) % num_procs;
+
+			ctr = 0;
+			for (int j = d * pos; j < num_procs; j++) {
+				if (j / pos % radix != d) continue;
+				entry_copy(contig_buf + ctr,
+						   recv_buffer +
+							   ((rank - j + num_procs) % num_procs) * msg_size,
+						   msg_size);
+				ctr += msg_size;
+			}
+			step_lap(STEP_PACK);
+
+			rsendrecv(write_proc, contig_buf, sizeof(T) * ctr, read_proc,
+					  tmpbuf, sizeof(T) * ctr);
+			step_lap(STEP_WIRE, sizeof(T) * ctr);
+
+			ctr = 0;
+			for (int j = d * pos; j < num_procs; j++) {
+				if (j / pos % radix != d) continue;
+				entry_copy(recv_buffer +
+							   ((rank - j + num_procs) % num_procs) * msg_size,
+						   tmpbuf + ctr, msg_size);
+				ctr += msg_size;
+			}
+			step_lap(STEP_UNPACK);
+			step_next();
+		}
+
+		// the next digit weight would not fit an int
+		if (pos > num_procs / radix) break;
+	}
+
+	free(contig_buf);
+	free(tmpbuf);
+
+	return 0;
+}
+
+// alltoall_bruck_entries for cells of any size: the cells are moved as the
+// widest entries of 16, 8, 4, 2 or 1 bytes they are made of, so odd sizes
+// fall back to narrower moves. The buffers need no alignment.
+int alltoall_bruck_radix(const void *sendbuf, const int entries_per_cell,
+						 void *recvbuf, int rank, int num_procs,
+						 int bytes_per_entry, int radix) {
+	size_t cell = (size_t)entries_per_cell * bytes_per_entry;
+	int n = cell / entry_width(cell);
+
+	switch (entry_width(cell)) {
+	case 16:
+		return alltoall_bruck_entries((const entry<16> *)sendbuf, n,
+									  (entry<16> *)recvbuf, rank, num_procs,
+									  radix);
+	case 8:
+		return alltoall_bruck_entries((const entry<8> *)sendbuf, n,
+									  (entry<8> *)recvbuf, rank, num_procs,
+									  radix);
+	case 4:
+		return alltoall_bruck_entries((const entry<4> *)sendbuf, n,
+									  (entry<4> *)recvbuf, rank, num_procs,
+									  radix);
+	case 2:
+		return alltoall_bruck_entries((const entry<2> *)sendbuf, n,
+									  (entry<2> *)recvbuf, rank, num_procs,
+									  radix);
+	default:
+		return alltoall_bruck_entries((const entry<1> *)sendbuf, n,
+									  (entry<1> *)recvbuf, rank, num_procs,
+									  radix);
+	}
+}
+
+// copies bytes from .. to of the message made of the cells idx of the radix
+// bruck step, between msg and the cells in recv_buffer; out packs, !out
+// unpacks
+void bruck_copy_range(char *msg, char *recv_buffer, const std::vector<int> &idx,
+					  size_t msg_size, int rank, int num_procs, size_t from,
+					  size_t to, bool out) {
+	size_t k = from / msg_size, off = from % msg_size;
+
+	while (from < to) {
+		size_t n = std::min(msg_size - off, to - from);
+		char *cell =
+			recv_buffer +
+			((rank - idx[k] + num_procs) % num_procs) * msg_size + off;
+
+		if (out)
+			block_copy(msg + from, cell, n);
+		else
+			block_copy(cell, msg + from, n);
+		from += n;
+		k++;
+		off = 0;
+	}
+}
+
+// The radix bruck with the copies of a step overlapped with its transfer.
+// The message of a step is packed segment bytes at a time, the next segment
+// once the previous one is in the ring, and the received bytes are unpacked
+// segment bytes at a time as they land. A received cell replaces the one
+// sent from the same place, so a range is only unpacked once it was packed.
+// The steps count as wire time as a whole, the copies hide in it.
+int alltoall_bruck_pipelined(const void *sendbuf, const int entries_per_cell,
+							 void *recvbuf, int rank, int num_procs,
+							 int bytes_per_entry, int radix, size_t segment) {
+	char *recv_buffer = (char *)recvbuf;
+	const char *send_buffer = (const char *)sendbuf;
+	size_t msg_size = (size_t)entries_per_cell * bytes_per_entry;
+	int write_proc, read_proc;
+	std::vector<int> idx;
+	size_t ctr;
+
+	char *contig_buf = (char *)malloc(msg_size * num_procs);
+	char *tmpbuf = (char *)malloc(msg_size * num_procs);
+
+	if (segment == 0) segment = msg_size * num_procs;
+
+	step_begin();
+
+	// the permutation can not be done in place
+	if (sendbuf == recvbuf) {
+		memcpy(tmpbuf, sendbuf, msg_size * num_procs);
+		send_buffer = tmpbuf;
+	}
+
+	for (int j = 0; j < num_procs; j++) {
+		int dst = (rank - j + num_procs) % num_procs;
+		int src = (rank + j) % num_procs;
+		block_copy(recv_buffer + dst * msg_size, send_buffer + src * msg_size,
+				   msg_size);
+	}
+	step_lap(STEP_LOCAL);
+
+	for (int pos = 1; pos < num_procs; pos *= radix) {
+		for (int d = 1; d < radix && d * pos < num_procs; d++) {
+			size_t packed = 0, sent = 0, recvd = 0, unpacked = 0;
+			unsigned spins = 0;
+
+			read_proc = (rank - d * pos + num_procs) % num_procs;
+			write_proc = (rank + d * pos) % num_procs;
+
+			idx.clear();
+			for (int j = d * pos; j < num_procs; j++)
+				if (j / pos % radix == d) idx.push_back(j);
+			ctr = idx.size() * msg_size;
+
+			while (sent < ctr || unpacked < ctr) {
+				bool moved = false;
+
+				if (packed < ctr && sent == packed) {
+					size_t to = std::min(packed + segment, ctr);
+					bruck_copy_range(contig_buf, recv_buffer, idx, msg_size,
+									 rank, num_procs, packed, to, true);
+					packed = to;
+					moved = true;
+				}
+
+				size_t n = rtry_write(write_proc, contig_buf + sent,
+									  packed - sent);
+				sent += n;
+				if (n > 0 && sent == ctr) rflush(write_proc);
+
+				ssize_t ret =
+					rtry_read(read_proc, tmpbuf + recvd, ctr - recvd);
+				if (ret < 0) {
+					std::cerr << "rtry_read failed: " << strerror(errno)
+							  << std::endl;
+					exit(-1);
+				}
+				recvd += ret;
+
+				size_t ready = std::min(recvd, packed);
+				if (ready - unpacked >= segment ||
+					(ready == ctr && unpacked < ctr)) {
+					bruck_copy_range(tmpbuf, recv_buffer, idx, msg_size, rank,
+									 num_procs, unpacked, ready, false);
+					unpacked = ready;
+					moved = true;
+				}
+
+				if (moved || n > 0 || ret > 0)
+					spins = 0;
+				else
+					ring_relax(spins);
+			}
+			step_lap(STEP_WIRE, ctr);
+			step_next();
+		}
+
+		// the next digit weight would not fit an int
+		if (pos > num_procs / radix) break;
+	}
+
+	free(contig_buf);
+	free(tmpbuf);
+
+	return 0;
+}
+
+// sends msg to write_proc while receiving the message of read_proc, laid out
+// the same way: the lengths of the rhdr.size() cells it carries, then the
+// cells. data is sized once the lengths are in.
+void exchange_sized(int write_proc, const std::vector<char> &msg,
+					int read_proc, std::vector<uint64_t> &rhdr,
+					std::vector<char> &data) {
+	size_t nhdr = rhdr.size() * sizeof(uint64_t);
+	size_t sent = 0, recvd = 0, nrecv = nhdr;
+	bool hdr_done = false;
+	unsigned spins = 0;
+	ssize_t ret;
+
+	while (sent < msg.size() || !hdr_done || recvd < nrecv) {
+		size_t n = rtry_write(write_proc, msg.data() + sent, msg.size() - sent);
+		sent += n;
+		if (n > 0 && sent == msg.size()) rflush(write_proc);
+
+		if (!hdr_done)
+			ret = rtry_read(read_proc, (char *)rhdr.data() + recvd,
+							nhdr - recvd);
+		else
+			ret = rtry_read(read_proc, data.data() + recvd - nhdr,
+							nrecv - recvd);
+		if (ret < 0) {
+			std::cerr << "rtry_read failed: " << strerror(errno)
+					  << std::endl;
+			exit(-1);
+		}
+		recvd += ret;
+
+		if (!hdr_done && recvd == nhdr) {
+			hdr_done = true;
+			for (auto l : rhdr) nrecv += l;
+			data.resize(nrecv - nhdr);
+		}
+
+		if (n > 0 || ret > 0)
+			spins = 0;
+		else
+			ring_relax(spins);
+	}
+}
+
+// alltoallv over the radix bruck steps. The cells have different lengths,
+// so every message starts with the lengths of the cells in it, and a cell
+// that still has to move on stays in the buffer it arrived in until it is
+// sent. A cell goes to its place in recvbuf at the step of its last digit.
+// Counts and displacements are in entries, like MPI_Alltoallv.
+int alltoallv_bruck(const void *sendbuf, const int *sendcounts,
+					const int *sdispls, void *recvbuf, const int *recvcounts,
+					const int *rdispls, int rank, int num_procs,
+					int bytes_per_entry, int radix) {
+	char *recv_buffer = (char *)recvbuf;
+	const char *send_buffer = (const char *)sendbuf;
+	int write_proc, read_proc;
+
+	// where the cell at index j is and its length in bytes
+	std::vector<const char *> cell(num_procs);
+	std::vector<uint64_t> len(num_procs);
+	// the buffers the cells that move on arrived in
+	std::vector<std::vector<char>> arrived;
+	std::vector<char> msg;
+
+	for (int j = 0; j < num_procs; j++) {
+		int src = (rank + j) % num_procs;
+		cell[j] = send_buffer + (size_t)sdispls[src] * bytes_per_entry;
+		len[j] = (size_t)sendcounts[src] * bytes_per_entry;
+	}
+
+	step_begin();
+
+	block_copy(recv_buffer + (size_t)rdispls[rank] * bytes_per_entry, cell[0],
+			   len[0]);
+	step_lap(STEP_LOCAL);
+
+	for (int pos = 1; pos < num_procs; pos *= radix) {
+		for (int d = 1; d < radix && d * pos < num_procs; d++) {
+			read_proc = (rank - d * pos + num_procs) % num_procs;
+			write_proc = (rank + d * pos) % num_procs;
+
+			std::vector<int> idx;
+			for (int j = d * pos; j < num_procs; j++)
+				if (j / pos % radix == d) idx.push_back(j);
+
+			size_t off = idx.size() * sizeof(uint64_t);
+			size_t total = off;
+			for (int j : idx) total += len[j];
+
+			msg.resize(total);
+			for (size_t k = 0; k < idx.size(); k++) {
+				memcpy(msg.data() + k * sizeof(uint64_t), &len[idx[k]],
+					   sizeof(uint64_t));
+				block_copy(msg.data() + off, cell[idx[k]], len[idx[k]]);
+				off += len[idx[k]];
+			}
+			step_lap(STEP_PACK);
+
+			std::vector<uint64_t> rhdr(idx.size());
+			arrived.emplace_back();
+			std::vector<char> &data = arrived.back();
+
+			exchange_sized(write_proc, msg, read_proc, rhdr, data);
+			step_lap(STEP_WIRE, msg.size());
+
+			off = 0;
+			for (size_t k = 0; k < idx.size(); k++) {
+				int j = idx[k];
+				int src = (rank - j + num_procs) % num_procs;
+
+				cell[j] = data.data() + off;
+				len[j] = rhdr[k];
+				off += len[j];
+
+				if (j / pos >= radix) continue;
+
+				// no digit left, the cell is home
+				if (len[j] != (size_t)recvcounts[src] * bytes_per_entry) {
+					std::cerr << "cell from " << src << " has " << len[j]
+							  << " bytes, expected "
+							  << (size_t)recvcounts[src] * bytes_per_entry
+							  << std::endl;
+					exit(-1);
+				}
+				block_copy(recv_buffer + (size_t)rdispls[src] * bytes_per_entry,
+						   cell[j], len[j]);
+			}
+			step_lap(STEP_UNPACK);
+			step_next();
+		}
+
+		if (pos > num_procs / radix) break;
+	}
+
+	return 0;
+}
+
+int alltoall_bruck(const void *sendbuf, const int entries_per_cell,
+				   void *recvbuf, int rank, int num_procs,
+				   int bytes_per_entry) {
+	char *recv_buffer = (char *)recvbuf;
+
+	// the halving below only covers powers of two
+	if (num_procs & (num_procs - 1))
+		return alltoall_bruck_radix(sendbuf, entries_per_cell, recvbuf, rank,
+									num_procs, bytes_per_entry, 2);
+
+	step_begin();
+
+	if (sendbuf != recvbuf) {
+		memcpy(recvbuf, sendbuf,
+			   entries_per_cell * bytes_per_entry * num_procs);
+	}
+
+	// Perform all-to-all
+	int stride, ctr, group_size;
+	int write_proc, read_proc, size;
+	int num_steps = log2(num_procs);
+	int msg_size = entries_per_cell * bytes_per_entry;
+	int total_cells = entries_per_cell * num_procs;
+
+	// TODO : could have only half this size
+	char *contig_buf = (char *)malloc(total_cells * bytes_per_entry);
+	char *tmpbuf = (char *)malloc(total_cells * bytes_per_entry);
+
+	// 1. rotate local data
+	if (rank) {
+		rotate(recv_buffer, rank * msg_size, num_procs * msg_size);
+	}
+	step_lap(STEP_LOCAL);
+
+	// 2. send to left, recv from right
+	stride = 1;
+	for (int i = 0; i < num_steps; i++) {
+		read_proc = rank - stride;
+		if (read_proc < 0) read_proc += num_procs;
+		write_proc = rank + stride;
+		if (write_proc >= num_procs) write_proc -= num_procs;
+
+		group_size = stride * entries_per_cell;
+
+		// the cells to send come in runs of group_size, one copy per run
+		ctr = 0;
+		for (int i = group_size; i < total_cells; i += (group_size * 2)) {
+			block_copy(contig_buf + ctr * bytes_per_entry,
+					   recv_buffer + i * bytes_per_entry,
+					   group_size * bytes_per_entry);
+			ctr += group_size;
+		}
+
+		size = ((int)(total_cells / group_size) * group_size) / 2;
+		size *= bytes_per_entry;
+		step_lap(STEP_PACK);
+
+		// a step may be larger than the rings hold, so both directions
+		// move at once
+		rsendrecv(write_proc, contig_buf, size, read_proc, tmpbuf, size);
+		step_lap(STEP_WIRE, size);
+
+		ctr = 0;
+		for (int i = group_size; i < total_cells; i += (group_size * 2)) {
+			block_copy(recv_buffer + i * bytes_per_entry,
+					   tmpbuf + ctr * bytes_per_entry,
+					   group_size * bytes_per_entry);
+			ctr += group_size;
+		}
+		step_lap(STEP_UNPACK);
+		step_next();
+
+		stride *= 2;
+	}
+
+	// 3. rotate local data
+	if (rank < num_procs) {
+		rotate(recv_buffer, (rank + 1) * msg_size, num_procs * msg_size);
+	}
+
+	// the cell from rank - i ended up at num_procs - 1 - i, reverse the cells
+	for (int i = 0; i < num_procs / 2; i++) {
+		std::swap_ranges(recv_buffer + i * msg_size,
+						 recv_buffer + (i + 1) * msg_size,
+						 recv_buffer + (num_procs - 1 - i) * msg_size);
+	}
+	step_lap(STEP_LOCAL);
+
+	free(contig_buf);
+	free(tmpbuf);
+
+	return 0;
+}
+
+#endif
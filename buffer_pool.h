@@ -0,0 +1,95 @@
+#ifndef BUFFER_POOL_H
+#define BUFFER_POOL_H
+
+#include <infiniband/verbs.h>
+#include <sys/mman.h>
+
+#include <algorithm>
+#include <cstdint>
+
+// Memory the rdma process hands to the NIC, mapped and registered once at
+// startup so nothing is registered while messages are moving. The pool is
+// carved into slabs whose sizes are powers of two, aligned to their size up
+// to 4KB; they live as long as the pool. pool_reserve tells how much of the
+// pool a slab takes, alignment included, so the pool can be sized for the
+// slabs that will be taken from it. With hugepages the pool is backed by 2MB
+// pages (MAP_HUGETLB, falling back to transparent huge pages when none are
+// reserved), which keeps the NIC's address translations for large receive
+// areas to a handful of entries.
+
+#define POOL_MIN_CLASS 6
+#define POOL_HUGEPAGE_SIZE (2ul << 20)
+
+struct buffer_pool {
+	char *base;
+	size_t size;
+	size_t used;
+	struct ibv_mr *mr;
+};
+
+inline int pool_class(size_t size) {
+	int c = POOL_MIN_CLASS;
+	while (((size_t)1 << c) < size) c++;
+	return c;
+}
+
+inline struct buffer_pool *pool_create(struct ibv_pd *pd, size_t size,
+									   bool hugepages, int access) {
+	struct buffer_pool *pool;
+	void *addr = MAP_FAILED;
+
+	if (hugepages) {
+		size = (size + POOL_HUGEPAGE_SIZE - 1) & ~(POOL_HUGEPAGE_SIZE - 1);
+		addr = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+					MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+	}
+
+	if (addr == MAP_FAILED) {
+		addr = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+					MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (addr == MAP_FAILED) return nullptr;
+		if (hugepages) madvise(addr, size, MADV_HUGEPAGE);
+	}
+
+	pool = new buffer_pool;
+	pool->base = (char *)addr;
+	pool->size = size;
+	pool->used = 0;
+
+	pool->mr = ibv_reg_mr(pd, addr, size, access);
+	if (!pool->mr) {
+		munmap(addr, size);
+		delete pool;
+		return nullptr;
+	}
+
+	return pool;
+}
+
+inline void pool_destroy(struct buffer_pool *pool) {
+	ibv_dereg_mr(pool->mr);
+	munmap(pool->base, pool->size);
+	delete pool;
+}
+
+// the bytes of the pool in use once a slab of at least size bytes is taken
+// after the first used ones; a slab is aligned to its size class up to 4KB
+inline size_t pool_reserve(size_t used, size_t size) {
+	size_t slab = (size_t)1 << pool_class(size);
+	size_t align = std::min(slab, (size_t)4096);
+
+	return ((used + align - 1) & ~(align - 1)) + slab;
+}
+
+// a slab of at least size bytes, or nullptr when the pool is exhausted
+inline void *pool_alloc(struct buffer_pool *pool, size_t size) {
+	size_t end = pool_reserve(pool->used, size);
+	size_t slab = (size_t)1 << pool_class(size);
+
+	if (end > pool->size) return nullptr;
+
+	pool->used = end;
+	return pool->base + end - slab;
+}
+
+#endif
@@ -0,0 +1,318 @@
+#ifndef COMM_H
+#define COMM_H
+
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "shm_ring.h"
+#include "shm_window.h"
+#include "stats.h"
+#include "transport.h"
+
+// the rank of the calling thread and its transport; with the loopback
+// transport every rank is a thread of its own
+thread_local int myrank;
+thread_local struct transport *comm;
+// the window of this rank, only for the zero copy algorithms
+struct shm_window *win;
+
+// Where the time of a collective goes, per step: the local copies done
+// outside the steps, packing the cells of a step into one message, the
+// exchange itself and unpacking. Step s is the s-th exchange of the
+// collective, the ones from STAT_STEPS - 1 on share the last entry. A wire
+// time well above what the bytes of the step need points at the network or at
+// a peer that came late, pack and unpack times at the CPU.
+#define STAT_STEPS 32
+
+#define STEP_LOCAL 0
+#define STEP_PACK 1
+#define STEP_WIRE 2
+#define STEP_UNPACK 3
+#define STEP_PHASES 4
+
+struct step_stats {
+	stat_counter collectives;
+	stat_counter bytes[STAT_STEPS];
+	struct stat_hist time[STEP_PHASES][STAT_STEPS];
+};
+
+thread_local struct step_stats steps;
+// the current step and when its current phase started
+thread_local int step_idx;
+thread_local double step_mark;
+
+// at the start of a collective
+void step_begin() {
+	stat_add(steps.collectives, 1);
+	step_idx = 0;
+	step_mark = stat_now_us();
+}
+
+// ends the current phase of the current step; a STEP_WIRE phase also counts
+// the bytes sent
+void step_lap(int phase, size_t bytes = 0) {
+	double now = stat_now_us();
+	int s = std::min(step_idx, STAT_STEPS - 1);
+
+	hist_add(steps.time[phase][s], (uint64_t)(now - step_mark));
+	if (bytes) stat_add(steps.bytes[s], bytes);
+	step_mark = now;
+}
+
+void step_next() { step_idx++; }
+
+void steps_json(std::ostream &out) {
+	static const char *phases[STEP_PHASES] = {"local", "pack", "wire",
+											  "unpack"};
+	bool first = true;
+
+	out << "{\"rank\": " << myrank
+		<< ", \"collectives\": " << stat_get(steps.collectives)
+		<< ", \"steps\": [";
+	for (int s = 0; s < STAT_STEPS; s++) {
+		bool used = false;
+		for (int ph = 0; ph < STEP_PHASES; ph++)
+			used |= stat_get(steps.time[ph][s].count) > 0;
+		if (!used) continue;
+
+		out << (first ? "" : ",") << "\n  {\"step\": " << s
+			<< ", \"bytes\": " << stat_get(steps.bytes[s]);
+		for (int ph = 0; ph < STEP_PHASES; ph++) {
+			out << ", \"" << phases[ph] << "\": ";
+			hist_json(out, steps.time[ph][s]);
+		}
+		out << "}";
+		first = false;
+	}
+	out << "]}" << std::endl;
+}
+
+// steps_json into the file at path, false if it could not be written
+bool steps_save(const std::string &path) {
+	std::ofstream out(path);
+	steps_json(out);
+	return (bool)out;
+}
+
+// ring carrying the data that rank "from" sends to rank "to"
+std::string ring_name(int from, int to) {
+	return "/ring-" + std::to_string(from) + "-" + std::to_string(to);
+}
+
+// the shared memory rings to the rdma process of the rank
+struct ring_transport : transport {
+	// out[i] carries what we send to rank i, in[i] what rank i sends us
+	std::vector<struct shm_ring *> out, in;
+	// the doorbell of the rdma process, rung through the out rings
+	int bell;
+
+	ssize_t read(int from, void *buff, size_t nbyte) override {
+		return ring_read(in[from], buff, nbyte);
+	}
+
+	ssize_t write(int to, const void *buff, size_t nbyte) override {
+		ssize_t ret = ring_write(out[to], buff, nbyte);
+		flush(to);
+		return ret;
+	}
+
+	ssize_t try_read(int from, void *buff, size_t nbyte) override {
+		return ring_try_read(in[from], buff, nbyte);
+	}
+
+	size_t try_write(int to, const void *buff, size_t nbyte) override {
+		return ring_try_write(out[to], buff, nbyte);
+	}
+
+	// the rdma process writes len bytes at src_off of our window to dst_off
+	// of the window of "to", which gets tag with a RING_NOTIFY once they
+	// landed
+	void put(int to, uint64_t src_off, uint64_t dst_off, uint64_t len,
+			 uint32_t tag) override {
+		struct ring_put put = {src_off, dst_off, len, tag};
+		ring_push(out[to], RING_PUT, &put, sizeof(put));
+	}
+
+	// a full ring is a batch by itself, the flush is not worth waiting for
+	void flush(int to) override { ring_try_push(out[to], RING_FLUSH, "", 0); }
+
+	// the rdma process releases ring space once the writes out of it, the
+	// puts included, completed
+	void wait_sent(int to) override {
+		unsigned spins = 0;
+		while (!ring_drained(out[to])) ring_relax(spins);
+	}
+
+	uint32_t wait_put(int from) override {
+		uint32_t tag;
+		if (ring_read_rec(in[from], RING_NOTIFY, &tag, sizeof(tag)) !=
+			sizeof(tag)) {
+			std::cerr << "no put notification from " << from << ": "
+					  << strerror(errno) << std::endl;
+			exit(-1);
+		}
+		return tag;
+	}
+
+	void close() override {
+		unsigned spins = 0;
+
+		// the rdma process releases ring space only once the writes out of
+		// it completed, so a drained ring has nothing in flight anymore
+		for (int i = 0; i < num_procs; i++) {
+			if (i == rank) continue;
+			while (!ring_drained(out[i])) ring_relax(spins);
+		}
+
+		for (int i = 0; i < num_procs; i++) {
+			if (i == rank) continue;
+			ring_close(out[i]);
+			ring_unmap(out[i]);
+			ring_close(in[i]);
+			ring_unmap(in[i]);
+		}
+		::close(bell);
+	}
+};
+
+ssize_t rread(int rank, void *buff, size_t nbyte) {
+	return comm->read(rank, buff, nbyte);
+}
+
+ssize_t rwrite(int rank, void *buff, size_t nbyte) {
+	return comm->write(rank, buff, nbyte);
+}
+
+// ends a batch of writes to rank, see transport.h; rwrite and rsendrecv end
+// theirs themselves
+void rflush(int rank) { comm->flush(rank); }
+
+// non-blocking rread / rwrite, they move what they can and return how much
+ssize_t rtry_read(int rank, void *buff, size_t nbyte) {
+	return comm->try_read(rank, buff, nbyte);
+}
+
+size_t rtry_write(int rank, const void *buff, size_t nbyte) {
+	return comm->try_write(rank, buff, nbyte);
+}
+
+// sends nsend bytes to write_rank while receiving nrecv bytes from
+// read_rank; unlike rwrite followed by rread it can not deadlock when every
+// rank sends more than the rings hold at once
+void rsendrecv(int write_rank, const void *sbuff, size_t nsend, int read_rank,
+			   void *rbuff, size_t nrecv) {
+	const char *cs = (const char *)sbuff;
+	char *cr = (char *)rbuff;
+	size_t sent = 0, recvd = 0;
+	unsigned spins = 0;
+
+	while (sent < nsend || recvd < nrecv) {
+		size_t n = rtry_write(write_rank, cs + sent, nsend - sent);
+		ssize_t ret = rtry_read(read_rank, cr + recvd, nrecv - recvd);
+		if (ret < 0) {
+			std::cerr << "rtry_read failed: " << strerror(errno) << std::endl;
+			exit(-1);
+		}
+		sent += n;
+		recvd += ret;
+
+		if (n > 0 || ret > 0)
+			spins = 0;
+		else
+			ring_relax(spins);
+	}
+	rflush(write_rank);
+}
+
+// has len bytes at src, in the window, written to dst_off of the window of
+// rank; rank gets tag from rwait_put once they landed
+void rput(int rank, const void *src, uint64_t dst_off, uint64_t len,
+		  uint32_t tag) {
+	comm->put(rank, win_offset(win, src), dst_off, len, tag);
+}
+
+// blocks until a put of rank landed in our window, returns its tag
+uint32_t rwait_put(int rank) { return comm->wait_put(rank); }
+
+// blocks until what we wrote and put to rank left our buffers
+void rwait_sent(int rank) { comm->wait_sent(rank); }
+
+struct transport *open_rings(int num_procs) {
+	struct ring_transport *t = new ring_transport;
+	std::string ring_wr, ring_rd;
+
+	t->rank = myrank;
+	t->num_procs = num_procs;
+	t->out.resize(num_procs);
+	t->in.resize(num_procs);
+
+	t->bell = ring_bell_open(ring_bell_name(myrank));
+	if (t->bell == -1) {
+		std::cerr << "open error on doorbell " << ring_bell_name(myrank)
+				  << ": " << strerror(errno) << std::endl;
+		exit(-1);
+	}
+
+	for (int i = 0; i < num_procs; i++) {
+		if (i == myrank) continue;
+
+		ring_rd = ring_name(i, myrank);
+		ring_wr = ring_name(myrank, i);
+
+		t->out[i] = ring_open(ring_wr);
+		if (!t->out[i]) {
+			std::cerr << "open error on ring_wr " << ring_wr << ": "
+					  << strerror(errno) << std::endl;
+			exit(-1);
+		}
+		t->out[i]->doorbell = t->bell;
+
+		t->in[i] = ring_open(ring_rd);
+		if (!t->in[i]) {
+			std::cerr << "open error on ring_rd " << ring_rd << ": "
+					  << strerror(errno) << std::endl;
+			exit(-1);
+		}
+	}
+	return t;
+}
+
+// counts and displacements for an alltoallv test with uneven cells: the cell
+// rank i sends to rank j has entries_per_cell + (i + 2 * j) % (skew + 1)
+// entries
+void skewed_counts(int num_procs, int entries_per_cell, int skew,
+				   std::vector<int> &sendcounts, std::vector<int> &sdispls,
+				   std::vector<int> &recvcounts, std::vector<int> &rdispls) {
+	sendcounts.resize(num_procs);
+	sdispls.resize(num_procs + 1);
+	recvcounts.resize(num_procs);
+	rdispls.resize(num_procs + 1);
+
+	sdispls[0] = rdispls[0] = 0;
+	for (int i = 0; i < num_procs; i++) {
+		sendcounts[i] = entries_per_cell + (myrank + 2 * i) % (skew + 1);
+		recvcounts[i] = entries_per_cell + (i + 2 * myrank) % (skew + 1);
+		sdispls[i + 1] = sdispls[i] + sendcounts[i];
+		rdispls[i + 1] = rdispls[i] + recvcounts[i];
+	}
+}
+
+struct shm_window *open_window() {
+	struct shm_window *w = win_attach(myrank);
+	if (!w) {
+		std::cerr << "attach error on window " << win_name(myrank) << ": "
+				  << strerror(errno) << std::endl;
+		exit(-1);
+	}
+	return w;
+}
+
+void close_rings(struct transport *t) {
+	t->close();
+	delete t;
+}
+
+#endif
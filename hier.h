@@ -0,0 +1,162 @@
+#ifndef HIER_H
+#define HIER_H
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "block_copy.h"
+#include "comm.h"
+
+// Two level alltoall for several ranks per node. Ranks of one node share the
+// rings directly, without their rdma processes in between, so only the
+// messages between nodes cost packets. The lowest rank of every node is its
+// leader:
+//   1. every other rank of the node hands the leader its whole sendbuf
+//   2. the leaders run a pairwise exchange over the nodes, the message to
+//      node m carries every cell from a rank of ours to a rank of m
+//   3. the leader hands every rank of the node the P cells meant for it
+// That is N - 1 messages between nodes per leader instead of P - 1 per rank,
+// each L * L' cells large, for N nodes of L and L' ranks.
+
+struct node_map {
+	// node_of[r] is the node of rank r, ranks[n] the ranks of node n in
+	// increasing order; ranks[n][0] is the leader
+	std::vector<int> node_of;
+	std::vector<std::vector<int>> ranks;
+};
+
+// the node map described by start.sh style "ip0:rank0 ip1:rank1 .." pairs,
+// ranks with the same ip share a node; nodes are numbered in the order of
+// their lowest rank
+struct node_map node_map_from_addrs(const std::string &addrs, int num_procs) {
+	struct node_map m;
+	std::vector<std::string> ip(num_procs);
+	std::map<std::string, int> node;
+	std::istringstream iss(addrs);
+	std::string a;
+
+	while (iss >> a) {
+		int r = std::stoi(a.substr(a.find(':') + 1));
+		if (r < 0 || r >= num_procs) {
+			std::cerr << "rank " << r << " in the addresses is out of range"
+					  << std::endl;
+			exit(-1);
+		}
+		ip[r] = a.substr(0, a.find(':'));
+	}
+
+	m.node_of.resize(num_procs);
+	for (int r = 0; r < num_procs; r++) {
+		auto it = node.find(ip[r]);
+		if (it == node.end()) {
+			it = node.emplace(ip[r], (int)m.ranks.size()).first;
+			m.ranks.emplace_back();
+		}
+		m.node_of[r] = it->second;
+		m.ranks[it->second].push_back(r);
+	}
+	return m;
+}
+
+// the largest number of ranks on one node
+int node_map_width(const struct node_map &m) {
+	size_t width = 0;
+	for (auto &r : m.ranks) width = std::max(width, r.size());
+	return width;
+}
+
+int alltoall_hier(const void *sendbuf, const int entries_per_cell,
+				  void *recvbuf, int rank, int num_procs, int bytes_per_entry,
+				  const struct node_map &m) {
+	size_t cell = (size_t)entries_per_cell * bytes_per_entry;
+	int num_nodes = m.ranks.size();
+	int node = m.node_of[rank];
+	const std::vector<int> &local = m.ranks[node];
+	int leader = local[0];
+	int num_local = local.size();
+
+	size_t nbyte = cell * num_procs;
+	ssize_t ret;
+
+	step_begin();
+
+	if (rank != leader) {
+		rwrite(leader, (void *)sendbuf, nbyte);
+		step_lap(STEP_WIRE, nbyte);
+		step_next();
+
+		ret = rread(leader, recvbuf, nbyte);
+		if (ret != (ssize_t)nbyte) {
+			std::cerr << "rread only read " << ret << " bytes from the leader"
+					  << std::endl;
+			exit(-1);
+		}
+		step_lap(STEP_WIRE);
+		return 0;
+	}
+
+	// all[i * P + d]: the cell local rank i sends to rank d
+	std::vector<char> all(num_local * nbyte);
+	block_copy(all.data(), sendbuf, nbyte);
+	for (int i = 1; i < num_local; i++) {
+		ret = rread(local[i], all.data() + i * nbyte, nbyte);
+		if (ret != (ssize_t)nbyte) {
+			std::cerr << "rread only read " << ret << " bytes from "
+					  << local[i] << std::endl;
+			exit(-1);
+		}
+	}
+	step_lap(STEP_WIRE);
+	step_next();
+
+	// out[i * P + s]: the cell rank s sends to local rank i
+	std::vector<char> out(num_local * nbyte);
+	for (int i = 0; i < num_local; i++)
+		for (int j = 0; j < num_local; j++)
+			block_copy(&out[(j * num_procs + local[i]) * cell],
+					   &all[(i * num_procs + local[j]) * cell], cell);
+	step_lap(STEP_LOCAL);
+
+	std::vector<char> msg, tmp;
+	for (int k = 1; k < num_nodes; k++) {
+		int to = (node + k) % num_nodes;
+		int from = (node - k + num_nodes) % num_nodes;
+		const std::vector<int> &remote = m.ranks[to];
+		const std::vector<int> &source = m.ranks[from];
+
+		// cell of local rank i for rank j of node "to" at i * |to| + j
+		msg.resize(num_local * remote.size() * cell);
+		for (int i = 0; i < num_local; i++)
+			for (size_t j = 0; j < remote.size(); j++)
+				block_copy(&msg[(i * remote.size() + j) * cell],
+						   &all[(i * num_procs + remote[j]) * cell], cell);
+		step_lap(STEP_PACK);
+
+		tmp.resize(source.size() * num_local * cell);
+		rsendrecv(m.ranks[to][0], msg.data(), msg.size(), m.ranks[from][0],
+				  tmp.data(), tmp.size());
+		step_lap(STEP_WIRE, msg.size());
+
+		for (size_t i = 0; i < source.size(); i++)
+			for (int j = 0; j < num_local; j++)
+				block_copy(&out[(j * num_procs + source[i]) * cell],
+						   &tmp[(i * num_local + j) * cell], cell);
+		step_lap(STEP_UNPACK);
+		step_next();
+	}
+
+	block_copy(recvbuf, out.data(), nbyte);
+	for (int i = 1; i < num_local; i++)
+		rwrite(local[i], out.data() + i * nbyte, nbyte);
+	step_lap(STEP_WIRE, (num_local - 1) * nbyte);
+
+	return 0;
+}
+
+#endif
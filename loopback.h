@@ -0,0 +1,90 @@
+#ifndef LOOPBACK_H
+#define LOOPBACK_H
+
+#include <thread>
+#include <vector>
+
+#include "comm.h"
+#include "shm_ring.h"
+#include "transport.h"
+
+// Every rank is a thread of one process and the ranks talk through the same
+// single-producer single-consumer rings the rdma process uses, only in
+// private memory and without the rdma process in between: rank i writes
+// straight into the ring rank j reads. It needs no device, no start.sh and
+// no /dev/shm, so the algorithms can be run and profiled at P in the hundreds
+// on one machine.
+
+#define LOOPBACK_RING_SIZE (64 << 10)
+
+struct loopback_transport : transport {
+	// rings[from * num_procs + to], shared by all the ranks
+	std::vector<struct shm_ring *> *rings;
+
+	struct shm_ring *ring(int from, int to) {
+		return (*rings)[from * num_procs + to];
+	}
+
+	ssize_t read(int from, void *buff, size_t nbyte) override {
+		return ring_read(ring(from, rank), buff, nbyte);
+	}
+
+	ssize_t write(int to, const void *buff, size_t nbyte) override {
+		return ring_write(ring(rank, to), buff, nbyte);
+	}
+
+	ssize_t try_read(int from, void *buff, size_t nbyte) override {
+		return ring_try_read(ring(from, rank), buff, nbyte);
+	}
+
+	size_t try_write(int to, const void *buff, size_t nbyte) override {
+		return ring_try_write(ring(rank, to), buff, nbyte);
+	}
+
+	// the rings are freed by loopback_run once every rank is done
+	void close() override {
+		for (int i = 0; i < num_procs; i++)
+			if (i != rank) ring_close(ring(rank, i));
+	}
+};
+
+// runs fn(rank) for every rank on a thread of its own, with myrank and comm
+// of the thread set up; returns once all of them returned
+template <typename F>
+void loopback_run(int num_procs, size_t ring_size, F fn) {
+	std::vector<struct shm_ring *> rings(num_procs * num_procs);
+	std::vector<std::thread> threads;
+
+	for (int i = 0; i < num_procs; i++) {
+		for (int j = 0; j < num_procs; j++) {
+			if (i == j) continue;
+			rings[i * num_procs + j] = ring_create(ring_size);
+			if (!rings[i * num_procs + j]) {
+				std::cerr << "ring_create failed: " << strerror(errno)
+						  << std::endl;
+				exit(-1);
+			}
+		}
+	}
+
+	for (int r = 0; r < num_procs; r++) {
+		threads.emplace_back([&, r] {
+			struct loopback_transport t;
+			t.rank = r;
+			t.num_procs = num_procs;
+			t.rings = &rings;
+
+			myrank = r;
+			comm = &t;
+			fn(r);
+			t.close();
+		});
+	}
+
+	for (auto &t : threads) t.join();
+
+	for (auto r : rings)
+		if (r) ring_unmap(r);
+}
+
+#endif
@@ -0,0 +1,271 @@
+#ifndef PAIRWISE_H
+#define PAIRWISE_H
+
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <vector>
+
+#include "block_copy.h"
+#include "comm.h"
+
+// the buffers hold entries_per_cell entries of type T per cell, offsets are
+// counted in entries
+template <typename T>
+int alltoall_pairwise(const T *sendbuf, const int entries_per_cell,
+					  T *recvbuf, int rank, int num_procs) {
+	int write_proc, read_proc;
+	size_t send_pos, recv_pos;
+
+	T *recv_buffer = recvbuf;
+	const T *send_buffer = sendbuf;
+
+	step_begin();
+
+	// our own cell does not go through the rings
+	entry_copy(recv_buffer + (size_t)rank * entries_per_cell,
+			   send_buffer + (size_t)rank * entries_per_cell,
+			   entries_per_cell);
+	step_lap(STEP_LOCAL);
+
+	// Send to rank + i
+	// Recv from rank - i
+	for (int i = 1; i < num_procs; i++) {
+		size_t size = sizeof(T) * entries_per_cell;
+
+		write_proc = rank + i;
+		if (write_proc >= num_procs) write_proc -= num_procs;
+		read_proc = rank - i;
+		if (read_proc < 0) read_proc += num_procs;
+
+		send_pos = (size_t)write_proc * entries_per_cell;
+		recv_pos = (size_t)read_proc * entries_per_cell;
+
+		// both directions at once, a cell larger than the ring would
+		// otherwise block both ranks of a pair in their writes
+		rsendrecv(write_proc, send_buffer + send_pos, size, read_proc,
+				  recv_buffer + recv_pos, size);
+		step_lap(STEP_WIRE, size);
+		step_next();
+	}
+
+	return 0;
+}
+
+// alltoall_pairwise for cells of any size, moved as the widest entries of
+// 16, 8, 4, 2 or 1 bytes they are made of
+int alltoall_pairwise(const void *sendbuf, const int entries_per_cell,
+					  void *recvbuf, int rank, int num_procs,
+					  int bytes_per_entry) {
+	size_t cell = (size_t)entries_per_cell * bytes_per_entry;
+	int n = cell / entry_width(cell);
+
+	switch (entry_width(cell)) {
+	case 16:
+		return alltoall_pairwise((const entry<16> *)sendbuf, n,
+								 (entry<16> *)recvbuf, rank, num_procs);
+	case 8:
+		return alltoall_pairwise((const entry<8> *)sendbuf, n,
+								 (entry<8> *)recvbuf, rank, num_procs);
+	case 4:
+		return alltoall_pairwise((const entry<4> *)sendbuf, n,
+								 (entry<4> *)recvbuf, rank, num_procs);
+	case 2:
+		return alltoall_pairwise((const entry<2> *)sendbuf, n,
+								 (entry<2> *)recvbuf, rank, num_procs);
+	default:
+		return alltoall_pairwise((const entry<1> *)sendbuf, n,
+								 (entry<1> *)recvbuf, rank, num_procs);
+	}
+}
+
+// alltoallv: the cell for rank i is sendcounts[i] entries at sdispls[i] of
+// sendbuf, the one from rank i goes to rdispls[i] of recvbuf and has
+// recvcounts[i] entries, like MPI_Alltoallv. Every exchange moves its two
+// cells at once, their lengths differ.
+int alltoallv_pairwise(const void *sendbuf, const int *sendcounts,
+					   const int *sdispls, void *recvbuf, const int *recvcounts,
+					   const int *rdispls, int rank, int num_procs,
+					   int bytes_per_entry) {
+	int write_proc, read_proc;
+
+	char *recv_buffer = (char *)recvbuf;
+	const char *send_buffer = (const char *)sendbuf;
+
+	step_begin();
+
+	memcpy(recv_buffer + (size_t)rdispls[rank] * bytes_per_entry,
+		   send_buffer + (size_t)sdispls[rank] * bytes_per_entry,
+		   (size_t)sendcounts[rank] * bytes_per_entry);
+	step_lap(STEP_LOCAL);
+
+	for (int i = 1; i < num_procs; i++) {
+		write_proc = rank + i;
+		if (write_proc >= num_procs) write_proc -= num_procs;
+		read_proc = rank - i;
+		if (read_proc < 0) read_proc += num_procs;
+
+		rsendrecv(write_proc,
+				  send_buffer + (size_t)sdispls[write_proc] * bytes_per_entry,
+				  (size_t)sendcounts[write_proc] * bytes_per_entry, read_proc,
+				  recv_buffer + (size_t)rdispls[read_proc] * bytes_per_entry,
+				  (size_t)recvcounts[read_proc] * bytes_per_entry);
+		step_lap(STEP_WIRE,
+				 (size_t)sendcounts[write_proc] * bytes_per_entry);
+		step_next();
+	}
+
+	return 0;
+}
+
+// non-blocking variant: up to window exchanges (all P-1 with window 0) are in
+// flight at once. Every pass pushes as much as the out rings take and copies
+// out whatever arrived, in any order, so a slow peer does not hold up the
+// others; a finished exchange makes room for the next one.
+int alltoall_pairwise_nb(const void *sendbuf, const int entries_per_cell,
+						 void *recvbuf, int rank, int num_procs,
+						 int bytes_per_entry, int window) {
+	int write_proc, read_proc;
+	size_t size = (size_t)entries_per_cell * bytes_per_entry;
+	int next = 1, num_done = 0;
+	ssize_t ret;
+	unsigned spins = 0;
+
+	char *recv_buffer = (char *)recvbuf;
+	const char *send_buffer = (const char *)sendbuf;
+
+	// bytes of exchange i sent to rank + i and received from rank - i
+	std::vector<size_t> sent(num_procs), recvd(num_procs);
+	std::vector<int> active;
+
+	if (window <= 0 || window > num_procs - 1) window = num_procs - 1;
+
+	// the exchanges overlap, they all count as a single step
+	step_begin();
+
+	memcpy(recv_buffer + rank * size, send_buffer + rank * size, size);
+	step_lap(STEP_LOCAL);
+
+	while (num_done < num_procs - 1) {
+		bool progress = false;
+
+		while ((int)active.size() < window && next < num_procs)
+			active.push_back(next++);
+
+		for (size_t a = 0; a < active.size();) {
+			int i = active[a];
+
+			write_proc = rank + i;
+			if (write_proc >= num_procs) write_proc -= num_procs;
+			read_proc = rank - i;
+			if (read_proc < 0) read_proc += num_procs;
+
+			if (sent[i] < size) {
+				size_t n = rtry_write(write_proc,
+									  send_buffer + write_proc * size + sent[i],
+									  size - sent[i]);
+				sent[i] += n;
+				progress |= n > 0;
+				if (sent[i] == size) rflush(write_proc);
+			}
+
+			if (recvd[i] < size) {
+				ret = rtry_read(read_proc,
+								recv_buffer + read_proc * size + recvd[i],
+								size - recvd[i]);
+				if (ret < 0) {
+					std::cerr << "rtry_read failed: " << strerror(errno)
+							  << std::endl;
+					exit(-1);
+				}
+				recvd[i] += ret;
+				progress |= ret > 0;
+			}
+
+			if (sent[i] == size && recvd[i] == size) {
+				active[a] = active.back();
+				active.pop_back();
+				num_done++;
+			} else {
+				a++;
+			}
+		}
+
+		if (progress)
+			spins = 0;
+		else
+			ring_relax(spins);
+	}
+	step_lap(STEP_WIRE, size * (num_procs - 1));
+
+	return 0;
+}
+
+// zero copy variant: sendbuf and recvbuf live in the window, at the same
+// offsets on every rank, and every cell is written by the NIC straight from
+// our sendbuf into the recvbuf of its destination.
+//
+// Nothing is copied out of the rings, so the calls are fenced explicitly: a
+// rank first tells the ranks that put into it that its recvbuf is free, and
+// puts into a rank only once that rank told it so; a faster peer thus never
+// overwrites the recvbuf of the previous call while it is being read. The
+// call returns once our own puts completed, so sendbuf may be refilled.
+int alltoall_pairwise_zcopy(const void *sendbuf, const int entries_per_cell,
+							void *recvbuf, int rank, int num_procs,
+							int bytes_per_entry) {
+	int write_proc, read_proc;
+	size_t size = (size_t)entries_per_cell * bytes_per_entry;
+	uint64_t recv_off = win_offset(win, recvbuf);
+	char ready = 1;
+	ssize_t ret;
+
+	char *recv_buffer = (char *)recvbuf;
+	char *send_buffer = (char *)sendbuf;
+
+	step_begin();
+
+	for (int i = 1; i < num_procs; i++) {
+		read_proc = rank - i;
+		if (read_proc < 0) read_proc += num_procs;
+
+		rwrite(read_proc, &ready, sizeof(ready));
+	}
+
+	// the puts do not wait for each other, post all of them first
+	for (int i = 1; i < num_procs; i++) {
+		write_proc = rank + i;
+		if (write_proc >= num_procs) write_proc -= num_procs;
+
+		ret = rread(write_proc, &ready, sizeof(ready));
+		if (ret != sizeof(ready)) {
+			std::cerr << "no ready from " << write_proc << ": "
+					  << strerror(errno) << std::endl;
+			exit(-1);
+		}
+
+		rput(write_proc, send_buffer + write_proc * size,
+			 recv_off + rank * size, size, rank);
+	}
+
+	memcpy(recv_buffer + rank * size, send_buffer + rank * size, size);
+
+	for (int i = 1; i < num_procs; i++) {
+		read_proc = rank - i;
+		if (read_proc < 0) read_proc += num_procs;
+
+		if (rwait_put(read_proc) != (uint32_t)read_proc) {
+			std::cerr << "unexpected put from " << read_proc
+					  << std::endl;
+			exit(-1);
+		}
+	}
+
+	for (int i = 0; i < num_procs; i++)
+		if (i != rank) rwait_sent(i);
+	// the copy of our own cell overlaps the puts, it counts as wire time
+	step_lap(STEP_WIRE, size * (num_procs - 1));
+
+	return 0;
+}
+
+#endif
@@ -0,0 +1,250 @@
+#ifndef PROGRESS_H
+#define PROGRESS_H
+
+#include <pthread.h>
+#include <sched.h>
+
+#include <atomic>
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <thread>
+#include <vector>
+
+#include "comm.h"
+
+// Progress engine of a rank: a thread of its own drives the transport, so the
+// communication of a collective goes on while the threads that started it
+// compute. They hand it sends and receives through a lock-free queue that any
+// number of them may push into, and learn that one is done from the flag of
+// the request. Collectives of several threads share the one thread and the
+// rings.
+//
+// Requests to one peer move in the order they were submitted, sends and
+// receives separately, the bytes of the rings carry no tags. Collectives
+// that run at the same time must thus be started in the same order on every
+// rank. While requests of a thread are in flight the thread must not use
+// comm itself, the rings have a single producer and a single consumer.
+
+struct prog_req {
+	int peer;
+	bool send;
+	char *buf;
+	size_t len;
+	// bytes moved so far, only touched by the engine
+	size_t done;
+	std::atomic<bool> complete;
+	// link of the submission queue
+	struct prog_req *next;
+};
+
+struct progress {
+	struct transport *t;
+	// requests pushed and not taken by the engine yet, newest first
+	std::atomic<struct prog_req *> submitted;
+	std::atomic<bool> stop;
+	std::thread thread;
+	// owned by the engine: the requests of every peer in flight, in order
+	std::vector<std::deque<struct prog_req *>> sends, recvs;
+	int active;
+};
+
+// moves what the submission queue holds into the per peer queues, oldest
+// first
+void progress_take(struct progress *pg) {
+	struct prog_req *r = pg->submitted.exchange(nullptr,
+												 std::memory_order_acquire);
+	struct prog_req *fifo = nullptr;
+
+	while (r) {
+		struct prog_req *next = r->next;
+		r->next = fifo;
+		fifo = r;
+		r = next;
+	}
+
+	for (r = fifo; r; r = r->next) {
+		if (r->len == 0) {
+			r->complete.store(true, std::memory_order_release);
+			continue;
+		}
+		(r->send ? pg->sends : pg->recvs)[r->peer].push_back(r);
+		pg->active++;
+	}
+}
+
+// one pass over the peers with requests in flight; true if anything moved
+bool progress_poll(struct progress *pg) {
+	bool moved = false;
+
+	for (int i = 0; i < pg->t->num_procs && pg->active; i++) {
+		if (!pg->sends[i].empty()) {
+			struct prog_req *r = pg->sends[i].front();
+			size_t n = pg->t->try_write(i, r->buf + r->done, r->len - r->done);
+
+			r->done += n;
+			moved |= n > 0;
+			if (r->done == r->len) {
+				pg->t->flush(i);
+				pg->sends[i].pop_front();
+				pg->active--;
+				r->complete.store(true, std::memory_order_release);
+			}
+		}
+
+		if (!pg->recvs[i].empty()) {
+			struct prog_req *r = pg->recvs[i].front();
+			ssize_t ret =
+				pg->t->try_read(i, r->buf + r->done, r->len - r->done);
+
+			if (ret < 0) {
+				std::cerr << "[" << pg->t->rank
+						  << "] try_read failed: " << strerror(errno)
+						  << std::endl;
+				exit(-1);
+			}
+			r->done += ret;
+			moved |= ret > 0;
+			if (r->done == r->len) {
+				pg->recvs[i].pop_front();
+				pg->active--;
+				r->complete.store(true, std::memory_order_release);
+			}
+		}
+	}
+	return moved;
+}
+
+void progress_loop(struct progress *pg) {
+	unsigned spins = 0;
+
+	for (;;) {
+		progress_take(pg);
+
+		if (progress_poll(pg)) {
+			spins = 0;
+			continue;
+		}
+
+		// stop only once everything submitted before it is done
+		if (pg->stop.load(std::memory_order_acquire) && !pg->active &&
+			!pg->submitted.load(std::memory_order_acquire))
+			break;
+		ring_relax(spins);
+	}
+}
+
+// starts the engine of the transport t, on cpu if it is not -1
+struct progress *progress_start(struct transport *t, int cpu = -1) {
+	struct progress *pg = new progress;
+
+	pg->t = t;
+	pg->submitted = nullptr;
+	pg->stop = false;
+	pg->sends.resize(t->num_procs);
+	pg->recvs.resize(t->num_procs);
+	pg->active = 0;
+	pg->thread = std::thread(progress_loop, pg);
+
+	if (cpu >= 0) {
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		CPU_SET(cpu, &set);
+		int ret = pthread_setaffinity_np(pg->thread.native_handle(),
+										 sizeof(set), &set);
+		if (ret != 0)
+			std::cerr << "[" << t->rank << "] could not pin the progress "
+					  << "thread to cpu " << cpu << ": " << strerror(ret)
+					  << std::endl;
+	}
+	return pg;
+}
+
+// waits for the requests in flight and stops the engine
+void progress_stop(struct progress *pg) {
+	pg->stop.store(true, std::memory_order_release);
+	pg->thread.join();
+	delete pg;
+}
+
+// hands r to the engine; buf must stay valid until r is complete
+void progress_submit(struct progress *pg, struct prog_req *r, int peer,
+					 bool send, void *buf, size_t len) {
+	r->peer = peer;
+	r->send = send;
+	r->buf = (char *)buf;
+	r->len = len;
+	r->done = 0;
+	r->complete.store(false, std::memory_order_relaxed);
+
+	r->next = pg->submitted.load(std::memory_order_relaxed);
+	while (!pg->submitted.compare_exchange_weak(r->next, r,
+												std::memory_order_release,
+												std::memory_order_relaxed))
+		;
+}
+
+void progress_isend(struct progress *pg, struct prog_req *r, int to,
+					const void *buf, size_t len) {
+	progress_submit(pg, r, to, true, (void *)buf, len);
+}
+
+void progress_irecv(struct progress *pg, struct prog_req *r, int from,
+					void *buf, size_t len) {
+	progress_submit(pg, r, from, false, buf, len);
+}
+
+bool progress_test(struct prog_req *r) {
+	return r->complete.load(std::memory_order_acquire);
+}
+
+void progress_wait(struct prog_req *r) {
+	unsigned spins = 0;
+	while (!progress_test(r)) ring_relax(spins);
+}
+
+void progress_waitall(struct prog_req *reqs, int n) {
+	for (int i = 0; i < n; i++) progress_wait(&reqs[i]);
+}
+
+// the pairwise alltoall as requests to the engine: 2 * (num_procs - 1) of
+// them, in reqs, which the caller waits for. Every exchange is in flight at
+// once, the engine moves them all in every pass.
+void alltoall_ipost(struct progress *pg, const void *sendbuf,
+					const int entries_per_cell, void *recvbuf, int rank,
+					int num_procs, int bytes_per_entry,
+					struct prog_req *reqs) {
+	size_t size = (size_t)entries_per_cell * bytes_per_entry;
+	const char *send_buffer = (const char *)sendbuf;
+	char *recv_buffer = (char *)recvbuf;
+
+	memcpy(recv_buffer + rank * size, send_buffer + rank * size, size);
+
+	for (int i = 1; i < num_procs; i++) {
+		int write_proc = (rank + i) % num_procs;
+		int read_proc = (rank - i + num_procs) % num_procs;
+
+		progress_irecv(pg, &reqs[2 * (i - 1)], read_proc,
+					   recv_buffer + read_proc * size, size);
+		progress_isend(pg, &reqs[2 * (i - 1) + 1], write_proc,
+					   send_buffer + write_proc * size, size);
+	}
+}
+
+// alltoall_ipost and the wait for it
+int alltoall_progress(struct progress *pg, const void *sendbuf,
+					  const int entries_per_cell, void *recvbuf, int rank,
+					  int num_procs, int bytes_per_entry) {
+	std::vector<struct prog_req> reqs(2 * (num_procs - 1));
+
+	step_begin();
+	alltoall_ipost(pg, sendbuf, entries_per_cell, recvbuf, rank, num_procs,
+				   bytes_per_entry, reqs.data());
+	step_lap(STEP_LOCAL);
+	progress_waitall(reqs.data(), reqs.size());
+	step_lap(STEP_WIRE, (num_procs - 1) * (size_t)entries_per_cell *
+							bytes_per_entry);
+	return 0;
+}
+
+#endif
@@ -1,141 +1,701 @@
 #include <arpa/inet.h>
 #include <fcntl.h>
 #include <infiniband/verbs.h>
+#include <sched.h>
+#include <sys/epoll.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <boost/program_options.hpp>
 #include <cerrno>
 #include <fstream>
 #include <iostream>
+#include <map>
+#include <sstream>
 #include <string>
+#include <vector>
+
+#include "bootstrap.h"
+#include "buffer_pool.h"
+#include "shm_ring.h"
+#include "shm_window.h"
+#include "stats.h"
 
 using namespace std;
 
+#define MAX_QPS 8
+
+// what one side of a peer pair tells the other one about itself
 struct device_info {
 	union ibv_gid gid;
-	uint32_t send_qp_num, write_qp_num;
-	struct ibv_mr write_mr;
+	// the QPs of the pair, --qps of them
+	uint32_t num_qps;
+	uint32_t qp_num[MAX_QPS];
+	// where the peer should write its messages for us, num_slots buffers of
+	// slot_size bytes
+	uint64_t addr;
+	uint32_t rkey;
+	// where the peer should write the number of our slots it freed
+	uint64_t credit_addr;
+	uint32_t credit_rkey;
+	// the window, the target of RING_PUT records of the peer
+	uint64_t win_addr;
+	uint32_t win_rkey;
 };
 
-// int port = 9210;
-int port;
+// what the daemon counts per remote rank; completions are the CQEs of the
+// signaled work requests, completion_us their time from post to CQE
+struct peer_stats {
+	stat_counter bytes_posted, wrs_posted, records_posted, completions;
+	stat_counter msgs_received, bytes_received;
+	// passes of the progress loop that found records but no credits
+	stat_counter credit_stalls;
+	struct stat_hist completion_us;
+};
 
-int receive_data(struct device_info &data) {
-	int sockfd, connfd, len;
-	struct sockaddr_in servaddr;
+// what the daemon counts about its progress loop; iterations over
+// completions tells how much of the polling was in vain
+struct loop_stats {
+	stat_counter iterations, completions, sleeps;
+	// ibv_post_srq_recv calls that refilled the shared receive queue
+	stat_counter srq_refills;
+	struct stat_hist sleep_us;
+};
 
-	sockfd = socket(AF_INET, SOCK_STREAM, 0);
-	if (sockfd == -1) return 1;
+// one of the --qps QPs of a peer, all of them carry writes in both
+// directions. Work request i of a lane has wr_id i; only some are signaled,
+// a completion covers every work request of the lane before it. msgs[i %
+// sq_depth] is the number of messages the peer had posted with work request
+// i, so a completion tells which messages are done as far as the lane goes.
+struct lane {
+	struct ibv_qp *qp;
+	struct peer *peer;
+	uint64_t posted, completed;
+	vector<uint64_t> msgs;
+	// the msgs of the last completed work request
+	uint64_t done_msgs;
+	// when the signaled work requests were posted
+	vector<uint64_t> time;
+};
 
-	memset(&servaddr, 0, sizeof(servaddr));
+// everything the daemon keeps about one remote rank
+struct peer {
+	int rank;
+	string ip;
+	vector<struct lane> lanes;
+	struct device_info remote;
+	// out carries what the local algorithm sends to the peer, in carries what
+	// the peer sends to the local algorithm
+	struct shm_ring *out, *in;
+	struct ibv_mr *out_mr;
+	// send side: sent counts the remote slots used so far, a message takes
+	// the next slots (see slot_place) once the peer freed them; the peer
+	// writes the number of slots it freed into credits
+	uint64_t sent;
+	volatile uint64_t *credits;
+	// message m is the m-th one posted, its sequence number; it goes over
+	// one lane, the next one in turn, or is striped over all of them. It
+	// hands the out ring back up to msg_release[m % msg_release.size()] once
+	// it completed on every lane, msg_completed messages did
+	uint64_t msg_posted, msg_completed;
+	vector<uint64_t> msg_release;
+	int next_lane;
+	// receive side: num_slots buffers of the pool where the peer writes its
+	// messages; consumed ones were pushed into the in ring and their slots
+	// handed back to the peer. The parts of message m land in any order,
+	// msg_got[m % num_slots] counts them and msg_imm holds their immediate;
+	// freed counts the slots the consumed messages used
+	char *recv_buf;
+	vector<uint32_t> msg_imm;
+	vector<uint8_t> msg_got;
+	uint64_t consumed, freed;
+	// records of message consumed that are already in the in ring
+	uint32_t consumed_off;
+	// with --coalesce_us: since when records wait in the out ring, 0 if
+	// none, and up to where it holds no RING_FLUSH
+	uint64_t pending_since, scanned;
+	// the freed count last written to the peer, and its source buffer
+	uint64_t returned;
+	uint64_t *credits_out;
+	uint32_t credit_lkey;
+	// the shutdown message went out once the local algorithm closed the out
+	// ring, the one of the peer arrived; with both and the send queue empty
+	// the peer is done
+	bool shutdown_sent, shutdown_got;
+	bool done;
+	struct peer_stats *stats;
+};
 
-	servaddr.sin_family = AF_INET;
-	servaddr.sin_addr.s_addr = htonl(INADDR_ANY);
-	servaddr.sin_port = htons(port);
+#define MAX_BATCH 64
+
+// the immediate of a message is its sequence number, modulo IMM_SEQ_MASK + 1,
+// and its length in 8 byte units, or IMM_PUT and the tag for the write of a
+// RING_PUT that went to the window, or a length of 0 for the last message to
+// the peer. IMM_STRIPED says it is one of --qps parts of a message, the
+// parts are written to the same slots, each over a lane of its own.
+#define IMM_PUT (1u << 31)
+#define IMM_STRIPED (1u << 30)
+#define IMM_SEQ_SHIFT 16
+#define IMM_SEQ_MASK 0x3fffu
+#define IMM_LOW_MASK 0xffffu
+
+uint32_t imm_make(uint32_t flags, uint64_t seq, uint32_t low) {
+	return flags | (uint32_t)(seq & IMM_SEQ_MASK) << IMM_SEQ_SHIFT | low;
+}
 
-	if ((bind(sockfd, (struct sockaddr *)&servaddr, sizeof(servaddr))) != 0)
-		return 1;
+// how long the progress loop sleeps at most while a peer waits for something
+// that wakes nobody: credits, which are plain writes, or room in an in ring
+#define STALL_MS 1
+
+int myrank;
+int num_slots, slot_size;
+int sq_depth, signal_every, batch;
+int coalesce_us;
+uint32_t coalesce_bytes;
+// lanes per peer and the size from which a message is striped over them
+int num_qps;
+uint64_t stripe_bytes;
+// every QP takes its receives from srq. It holds a receive for every part of
+// a message that can be in flight, num_qps for every slot of every peer, plus
+// srq_batch; srq_used receives were taken and are put back srq_batch at a
+// time
+struct ibv_srq *srq;
+int srq_batch, srq_used;
+vector<struct ibv_recv_wr> srq_wrs;
+struct shm_window *win;
+struct ibv_mr *win_mr;
+// indexed by rank; never freed, the metrics endpoint may read them until the
+// process exits
+struct peer_stats *peer_stats;
+struct loop_stats loop_stats;
+
+// whole microseconds of stat_now_us, what the histograms count in
+uint64_t now_us() { return stat_now_us(); }
+
+// move a QP through RTR and RTS, connected to the QP dest_qp_num of the peer
+int connect_qp(struct ibv_qp *qp, const struct peer &p, uint32_t dest_qp_num,
+			   const struct ibv_port_attr &port_attr, uint32_t gidIndex) {
+	struct ibv_qp_attr qp_attr;
+	int ret;
+
+	memset(&qp_attr, 0, sizeof(qp_attr));
+
+	qp_attr.path_mtu = port_attr.active_mtu;
+	qp_attr.qp_state = ibv_qp_state::IBV_QPS_RTR;
+	qp_attr.rq_psn = 0;
+	qp_attr.max_dest_rd_atomic = 1;
+	qp_attr.min_rnr_timer = 0;
+	qp_attr.ah_attr.is_global = 1;
+	qp_attr.ah_attr.sl = 0;
+	qp_attr.ah_attr.src_path_bits = 0;
+	qp_attr.ah_attr.port_num = 1;
+
+	memcpy(&qp_attr.ah_attr.grh.dgid, &p.remote.gid, sizeof(p.remote.gid));
+
+	qp_attr.ah_attr.grh.flow_label = 0;
+	qp_attr.ah_attr.grh.hop_limit = 5;
+	qp_attr.ah_attr.grh.sgid_index = gidIndex;
+	qp_attr.ah_attr.grh.traffic_class = 0;
 
-	if ((listen(sockfd, 5)) != 0) return 1;
+	qp_attr.ah_attr.dlid = 1;
+	qp_attr.dest_qp_num = dest_qp_num;
 
-	connfd = accept(sockfd, NULL, NULL);
-	if (connfd < 0) return 1;
+	// move the QP into the RTR state, using ibv_modify_qp
+	ret = ibv_modify_qp(qp, &qp_attr,
+						IBV_QP_STATE | IBV_QP_AV | IBV_QP_PATH_MTU |
+							IBV_QP_DEST_QPN | IBV_QP_RQ_PSN |
+							IBV_QP_MAX_DEST_RD_ATOMIC | IBV_QP_MIN_RNR_TIMER);
+	if (ret != 0) {
+		cerr << "[rdma-" << myrank
+			 << "] ibv_modify_qp - RTR - failed: " << strerror(ret) << endl;
+		return ret;
+	}
 
-	read(connfd, &data, sizeof(data));
+	qp_attr.qp_state = ibv_qp_state::IBV_QPS_RTS;
+	qp_attr.timeout = 0;
+	qp_attr.retry_cnt = 7;
+	qp_attr.rnr_retry = 7;
+	qp_attr.sq_psn = 0;
+	qp_attr.max_rd_atomic = 0;
 
-	close(sockfd);
+	// move the QP into the RTS state, using ibv_modify_qp
+	ret = ibv_modify_qp(qp, &qp_attr,
+						IBV_QP_STATE | IBV_QP_TIMEOUT | IBV_QP_RETRY_CNT |
+							IBV_QP_RNR_RETRY | IBV_QP_SQ_PSN |
+							IBV_QP_MAX_QP_RD_ATOMIC);
+	if (ret != 0) {
+		cerr << "[rdma-" << myrank
+			 << "] ibv_modify_qp - RTS - failed: " << strerror(ret) << endl;
+		return ret;
+	}
 
 	return 0;
 }
 
-ssize_t readall(int fd, void *buff, size_t nbyte) {
-	size_t nread = 0;
-	size_t res = 0;
-	char *cbuff = (char *)buff;
-	while (nread < nbyte) {
-		res = read(fd, cbuff + nread, nbyte - nread);
-		if (res == 0) {
-			cerr << "[rdma-" << port << "] read ret 0\n";
-			break;
-		}
-		if (res == -1) {
-			cerr << "[rdma-" << port << "] error read\n";
-			exit(-1);
-		}
-		nread += res;
+// put count receives into the shared receive queue with one call
+int post_recvs(int count) {
+	struct ibv_recv_wr *bad_wr_recv;
+	int ret;
+
+	// the data of a Write With Immediate goes to the address the sender
+	// picked, a receive work request only consumes the immediate
+	srq_wrs[count - 1].next = nullptr;
+	ret = ibv_post_srq_recv(srq, srq_wrs.data(), &bad_wr_recv);
+	srq_wrs[count - 1].next = count < srq_batch ? &srq_wrs[count] : nullptr;
+	return ret;
+}
+
+void lane_signal(struct lane &l, struct ibv_send_wr &wr) {
+	wr.send_flags |= IBV_SEND_SIGNALED;
+	l.time[wr.wr_id % sq_depth] = now_us();
+}
+
+// give a work request of the lane its id, decide whether it is signaled and
+// remember how many messages the peer posted with it
+void lane_track(struct lane &l, struct ibv_send_wr &wr, bool signal) {
+	wr.wr_id = l.posted;
+	if (signal || (l.posted + 1) % signal_every == 0) lane_signal(l, wr);
+	l.msgs[l.posted % sq_depth] = l.peer->msg_posted;
+	l.posted++;
+
+	stat_add(l.peer->stats->wrs_posted, 1);
+	for (int i = 0; i < wr.num_sge; i++)
+		stat_add(l.peer->stats->bytes_posted, wr.sg_list[i].length);
+}
+
+// a completion of work request wr_id of the lane; the messages done on every
+// lane hand their ring space back
+void lane_completed(struct lane &l, uint64_t wr_id) {
+	struct peer &p = *l.peer;
+	uint64_t done = p.msg_posted;
+
+	l.completed = wr_id + 1;
+	l.done_msgs = l.msgs[wr_id % sq_depth];
+
+	for (auto &o : p.lanes)
+		if (o.completed != o.posted) done = min(done, o.done_msgs);
+
+	if (done > p.msg_completed) {
+		p.msg_completed = done;
+		ring_release(p.out, p.msg_release[(done - 1) % p.msg_release.size()]);
 	}
-	return nread;
 }
 
-ssize_t writeall(int fd, void *buff, size_t nbyte) {
-	size_t nwrote = 0;
-	size_t res = 0;
-	char *cbuff = (char *)buff;
-	while (nwrote < nbyte) {
-		res = write(fd, cbuff + nwrote, nbyte - nwrote);
-		if (res == 0) break;
-		if (res == -1) {
-			cerr << "[rdma-" << port << "] error write\n";
-			exit(-1);
-		}
-		nwrote += res;
+int lane_space(struct lane &l) {
+	return sq_depth - (int)(l.posted - l.completed);
+}
+
+// nothing the peer posted is in flight any more
+bool sq_idle(struct peer &p) {
+	for (auto &l : p.lanes)
+		if (l.completed != l.posted) return false;
+	return true;
+}
+
+// the parts message m is made of
+int msg_parts(uint32_t imm) { return imm & IMM_STRIPED ? num_qps : 1; }
+
+// whether every part of the next message to consume landed
+bool msg_landed(struct peer &p) {
+	int i = p.consumed % num_slots;
+	return p.msg_got[i] && p.msg_got[i] == msg_parts(p.msg_imm[i]);
+}
+
+// every lane has room for another work request
+bool sq_room(struct peer &p) {
+	for (auto &l : p.lanes)
+		if (lane_space(l) <= 0) return false;
+	return true;
+}
+
+// where part c of k of a message of len bytes starts, 8 byte aligned
+uint64_t stripe_off(uint64_t len, int c, int k) {
+	return c == k ? len : (len / k * c) & ~7ull;
+}
+
+// a message of len bytes takes the slots [start, start + nslots) of the slot
+// counter pos; it never wraps around the end of the slot array, the slots it
+// skips at the end count as used. Both sides of a peer pair compute the same
+// placement.
+void slot_place(uint64_t pos, uint32_t len, uint64_t &start, int &nslots) {
+	nslots = (len + slot_size - 1) / slot_size;
+	start = pos;
+	if ((int)(pos % num_slots) + nslots > num_slots)
+		start += num_slots - pos % num_slots;
+}
+
+// the bytes of slot space the message for a record needs; a RING_PUT goes to
+// the window but still takes a slot, for its receive work request
+uint32_t rec_wire_len(struct ring_rec *rec) {
+	return rec->type == RING_PUT ? 1 : ring_rec_size(rec->len);
+}
+
+// the slots a message may take at most
+int max_msg_slots() { return (RING_MAX_RECORD + slot_size - 1) / slot_size; }
+
+// whether the peer freed the slots the next message of len bytes takes
+bool has_slots(struct peer &p, uint32_t len) {
+	uint64_t start;
+	int nslots;
+
+	slot_place(p.sent, len, start, nslots);
+	return start + nslots - *p.credits <= (uint64_t)num_slots;
+}
+
+// whether the records in the out ring should go now. They always do unless
+// --coalesce_us is set; then they wait for coalesce_bytes of them, a
+// RING_FLUSH, the end of file or until the first one waited coalesce_us.
+bool batch_ready(struct peer &p) {
+	uint64_t now;
+
+	if (!ring_peek(p.out)) {
+		p.pending_since = 0;
+		return false;
 	}
-	return nwrote;
+	if (coalesce_us <= 0 || ring_closed(p.out)) return true;
+
+	now = now_us();
+	if (!p.pending_since) p.pending_since = now;
+	if (now - p.pending_since >= (uint64_t)coalesce_us) return true;
+
+	if (p.out->hdr->head.load(std::memory_order_acquire) - p.out->cursor >=
+		coalesce_bytes)
+		return true;
+
+	p.scanned = max(p.scanned, p.out->cursor);
+	return ring_holds(p.out, p.scanned, RING_FLUSH);
 }
 
-int send_data(const struct device_info &data, string ip) {
-	int sockfd;
-	int ret;
-	struct sockaddr_in servaddr;
+// post the records at the cursor of the out ring, as many as the peer has
+// slots for, the lanes have room for and fit in one batch, with one
+// ibv_post_send per lane. A message carries a run of records that are
+// contiguous in the ring, up to coalesce_bytes, header included; a RING_FLUSH
+// ends the run. RING_PUT records are carried out as a write from our window
+// to the window of the peer. A message of stripe_bytes or more is split over
+// all the lanes, a smaller one goes over the next lane in turn.
+int post_writes(struct peer &p) {
+	struct ibv_sge sg_write[MAX_QPS][MAX_BATCH];
+	struct ibv_send_wr wr_write[MAX_QPS][MAX_BATCH], *bad_wr_write;
+	int n[MAX_QPS] = {0};
+	int nq = p.lanes.size(), msgs = 0, ret;
+	struct ring_rec *rec;
+
+	for (;;) {
+		uint64_t start, len, src, dst;
+		uint32_t lkey, rkey, flags, low;
+		int nslots, k, first;
+		bool room = msgs < batch;
+
+		// every lane has room for a part, whichever lanes the message takes;
+		// the parts built so far already count as posted
+		for (int q = 0; q < nq; q++)
+			room &= n[q] < MAX_BATCH && lane_space(p.lanes[q]) > 0;
+		if (!room) break;
+
+		rec = ring_peek(p.out);
+		if (!rec || !has_slots(p, rec_wire_len(rec))) break;
+
+		if (rec->type == RING_PUT) {
+			struct ring_put *put = (struct ring_put *)ring_rec_data(rec);
+
+			if (!win || put->src_off + put->len > win->size ||
+				put->tag > IMM_LOW_MASK) {
+				cerr << "[rdma-" << myrank << "] bad put to " << p.rank
+					 << endl;
+				return EINVAL;
+			}
 
-	sockfd = socket(AF_INET, SOCK_STREAM, 0);
-	if (sockfd == -1) {
-		cerr << "[rdma-" << port << "] error socket\n";
-		return 1;
+			len = put->len;
+			src = (uintptr_t)(win->base + put->src_off);
+			lkey = win_mr->lkey;
+			dst = p.remote.win_addr + put->dst_off;
+			rkey = p.remote.win_rkey;
+			flags = IMM_PUT;
+			low = put->tag;
+
+			slot_place(p.sent, rec_wire_len(rec), start, nslots);
+			ring_advance(p.out);
+			stat_add(p.stats->records_posted, 1);
+		} else {
+			uint32_t size = ring_rec_size(rec->len);
+			struct ring_rec *next;
+
+			// take the records right behind it along, as long as they
+			// follow it in memory and the peer has the slots for them
+			ring_advance(p.out);
+			stat_add(p.stats->records_posted, 1);
+			while ((next = ring_peek(p.out)) && next->type != RING_PUT &&
+				   (char *)next == (char *)rec + size &&
+				   size + ring_rec_size(next->len) <= coalesce_bytes &&
+				   has_slots(p, size + ring_rec_size(next->len))) {
+				size += ring_rec_size(next->len);
+				ring_advance(p.out);
+				stat_add(p.stats->records_posted, 1);
+			}
+			slot_place(p.sent, size, start, nslots);
+
+			len = size;
+			src = (uintptr_t)rec;
+			lkey = p.out_mr->lkey;
+			dst = p.remote.addr + (start % num_slots) * slot_size;
+			rkey = p.remote.rkey;
+			flags = 0;
+			// records are padded to 8 bytes
+			low = size / 8;
+		}
+
+		if (nq > 1 && len >= stripe_bytes) {
+			k = nq;
+			first = 0;
+			flags |= IMM_STRIPED;
+		} else {
+			k = 1;
+			first = p.next_lane;
+			p.next_lane = (p.next_lane + 1) % nq;
+		}
+
+		p.msg_release[p.msg_posted % p.msg_release.size()] = p.out->cursor;
+		p.msg_posted++;
+		p.sent = start + nslots;
+		msgs++;
+
+		// one Write With Immediate per part, each with the immediate of
+		// the whole message
+		for (int c = 0; c < k; c++) {
+			struct lane &l = p.lanes[first + c];
+			struct ibv_sge &sg = sg_write[first + c][n[first + c]];
+			struct ibv_send_wr &wr = wr_write[first + c][n[first + c]];
+			uint64_t off = stripe_off(len, c, k);
+
+			memset(&sg, 0, sizeof(sg));
+			sg.addr = src + off;
+			sg.length = stripe_off(len, c + 1, k) - off;
+			sg.lkey = lkey;
+
+			memset(&wr, 0, sizeof(wr));
+			wr.sg_list = &sg;
+			wr.num_sge = 1;
+			wr.opcode = IBV_WR_RDMA_WRITE_WITH_IMM;
+			wr.imm_data = htonl(imm_make(flags, p.msg_posted - 1, low));
+			wr.wr.rdma.remote_addr = dst + off;
+			wr.wr.rdma.rkey = rkey;
+
+			if (n[first + c] > 0)
+				wr_write[first + c][n[first + c] - 1].next = &wr;
+			lane_track(l, wr, false);
+			n[first + c]++;
+		}
 	}
 
-	servaddr.sin_family = AF_INET;
-	servaddr.sin_addr.s_addr = inet_addr(ip.c_str());
-	servaddr.sin_port = htons(port);
+	// the last write of every lane is signaled, nothing may be posted right
+	// behind it and its ring space would never be released
+	for (int q = 0; q < nq; q++) {
+		if (n[q] == 0) continue;
 
-	if (connect(sockfd, (struct sockaddr *)&servaddr, sizeof(servaddr)) != 0) {
-		cerr << "[rdma-" << port << "] error connect: " << strerror(errno)
-			 << endl;
-		return 1;
+		struct ibv_send_wr &last = wr_write[q][n[q] - 1];
+		if (!(last.send_flags & IBV_SEND_SIGNALED))
+			lane_signal(p.lanes[q], last);
+
+		ret = ibv_post_send(p.lanes[q].qp, wr_write[q], &bad_wr_write);
+		if (ret != 0) return ret;
+	}
+
+	return 0;
+}
+
+// tell the peer how many of its slots we freed, a plain RDMA write into its
+// credit word, over the first lane
+int post_credits(struct peer &p) {
+	struct ibv_sge sg_write;
+	struct ibv_send_wr wr_write, *bad_wr_write;
+
+	*p.credits_out = p.freed;
+
+	memset(&sg_write, 0, sizeof(sg_write));
+	sg_write.addr = (uintptr_t)p.credits_out;
+	sg_write.length = sizeof(*p.credits_out);
+	sg_write.lkey = p.credit_lkey;
+
+	memset(&wr_write, 0, sizeof(wr_write));
+	wr_write.sg_list = &sg_write;
+	wr_write.num_sge = 1;
+	wr_write.opcode = IBV_WR_RDMA_WRITE;
+
+	wr_write.wr.rdma.remote_addr = p.remote.credit_addr;
+	wr_write.wr.rdma.rkey = p.remote.credit_rkey;
+
+	// signaled, or it could keep the lane from ever looking idle while it
+	// carries no message of its own
+	lane_track(p.lanes[0], wr_write, true);
+
+	return ibv_post_send(p.lanes[0].qp, &wr_write, &bad_wr_write);
+}
+
+// the last message to the peer, an empty write with a length of 0 in the
+// immediate, over the first lane; it takes a slot like any message. The
+// slots we freed are returned right before it, the peer may need them for
+// its own shutdown, and never after it: the peer tears its QPs down once it
+// got ours. Needs two free entries in the send queue of the first lane and a
+// free slot at the peer.
+int post_shutdown(struct peer &p) {
+	struct ibv_send_wr wr_write, *bad_wr_write;
+	uint64_t start;
+	int nslots, ret;
+
+	if (p.freed != p.returned) {
+		ret = post_credits(p);
+		if (ret != 0) return ret;
+		p.returned = p.freed;
 	}
 
-	writeall(sockfd, (void *)&data, sizeof(data));
+	slot_place(p.sent, 1, start, nslots);
+	p.sent = start + nslots;
+
+	p.msg_release[p.msg_posted % p.msg_release.size()] = p.out->cursor;
+	p.msg_posted++;
+
+	memset(&wr_write, 0, sizeof(wr_write));
+	wr_write.num_sge = 0;
+	wr_write.opcode = IBV_WR_RDMA_WRITE_WITH_IMM;
+	wr_write.imm_data = htonl(imm_make(0, p.msg_posted - 1, 0));
+	wr_write.wr.rdma.remote_addr =
+		p.remote.addr + (start % num_slots) * slot_size;
+	wr_write.wr.rdma.rkey = p.remote.rkey;
+
+	lane_track(p.lanes[0], wr_write, true);
+	p.shutdown_sent = true;
+
+	return ibv_post_send(p.lanes[0].qp, &wr_write, &bad_wr_write);
+}
+
+// arm the CQs and the doorbells of the out rings before the progress loop
+// goes to sleep
+int arm(vector<struct peer> &peers, struct ibv_cq *send_cq,
+		struct ibv_cq *recv_cq) {
+	int ret;
 
-	close(sockfd);
+	ret = ibv_req_notify_cq(send_cq, 0);
+	if (ret != 0) return ret;
+	ret = ibv_req_notify_cq(recv_cq, 0);
+	if (ret != 0) return ret;
 
+	for (auto &p : peers)
+		if (!p.done) ring_sleep(p.out, true);
 	return 0;
 }
 
+// after waking up: take the events off the channel, every one has to be
+// acknowledged before the CQs are destroyed, and empty the doorbell
+void disarm(vector<struct peer> &peers, struct ibv_comp_channel *channel,
+			int bell) {
+	struct ibv_cq *cq;
+	void *ctx;
+
+	while (ibv_get_cq_event(channel, &cq, &ctx) == 0) ibv_ack_cq_events(cq, 1);
+	ring_bell_drain(bell);
+
+	for (auto &p : peers) ring_sleep(p.out, false);
+}
+
+void stats_json(ostream &out, vector<struct peer> &peers) {
+	uint64_t completions = stat_get(loop_stats.completions);
+
+	out << "{\"rank\": " << myrank
+		<< ", \"iterations\": " << stat_get(loop_stats.iterations)
+		<< ", \"completions\": " << completions
+		<< ", \"iterations_per_completion\": "
+		<< (completions ? (double)stat_get(loop_stats.iterations) / completions
+						: 0)
+		<< ", \"sleeps\": " << stat_get(loop_stats.sleeps)
+		<< ", \"sleep_us\": ";
+	hist_json(out, loop_stats.sleep_us);
+	out << ", \"srq_refills\": " << stat_get(loop_stats.srq_refills)
+		<< ", \"peers\": [";
+	for (size_t i = 0; i < peers.size(); i++) {
+		struct peer_stats &ps = *peers[i].stats;
+
+		out << (i ? "," : "") << "\n  {\"rank\": " << peers[i].rank
+			<< ", \"bytes_posted\": " << stat_get(ps.bytes_posted)
+			<< ", \"wrs_posted\": " << stat_get(ps.wrs_posted)
+			<< ", \"records_posted\": " << stat_get(ps.records_posted)
+			<< ", \"completions\": " << stat_get(ps.completions)
+			<< ", \"msgs_received\": " << stat_get(ps.msgs_received)
+			<< ", \"bytes_received\": " << stat_get(ps.bytes_received)
+			<< ", \"credit_stalls\": " << stat_get(ps.credit_stalls)
+			<< ", \"completion_us\": ";
+		hist_json(out, ps.completion_us);
+		out << "}";
+	}
+	out << "]}" << endl;
+}
+
+string stats_prom(vector<struct peer> &peers) {
+	ostringstream out;
+	string me = "rank=\"" + to_string(myrank) + "\"";
+
+	counter_prom(out, "rdma_loop_iterations_total", me,
+				 stat_get(loop_stats.iterations));
+	counter_prom(out, "rdma_loop_completions_total", me,
+				 stat_get(loop_stats.completions));
+	counter_prom(out, "rdma_loop_sleeps_total", me,
+				 stat_get(loop_stats.sleeps));
+	hist_prom(out, "rdma_loop_sleep_seconds", me, loop_stats.sleep_us);
+	counter_prom(out, "rdma_srq_refills_total", me,
+				 stat_get(loop_stats.srq_refills));
+
+	for (auto &p : peers) {
+		struct peer_stats &ps = *p.stats;
+		string l = me + ",peer=\"" + to_string(p.rank) + "\"";
+
+		counter_prom(out, "rdma_bytes_posted_total", l,
+					 stat_get(ps.bytes_posted));
+		counter_prom(out, "rdma_wrs_posted_total", l, stat_get(ps.wrs_posted));
+		counter_prom(out, "rdma_records_posted_total", l,
+					 stat_get(ps.records_posted));
+		counter_prom(out, "rdma_completions_total", l,
+					 stat_get(ps.completions));
+		counter_prom(out, "rdma_msgs_received_total", l,
+					 stat_get(ps.msgs_received));
+		counter_prom(out, "rdma_bytes_received_total", l,
+					 stat_get(ps.bytes_received));
+		counter_prom(out, "rdma_credit_stalls_total", l,
+					 stat_get(ps.credit_stalls));
+		hist_prom(out, "rdma_completion_seconds", l, ps.completion_us);
+	}
+	return out.str();
+}
+
 int main(int argc, char *argv[]) {
-	bool server = false;
 	int num_devices, ret;
+	int num_procs, port;
+	int num_done;
+	int spin_us, bell = -1, epfd = -1;
+	string stats_file;
+	bool armed;
+	uint64_t last_work;
 	uint32_t gidIndex = 0;
-	string ip_str, remote_ip_str, dev_str;
-	char shared_buf[1000];
-	std::string pipe;
-	int pipefd;
-	int datasize;
+	string ip_str, dev_str, addrs, root_ip;
+	int credit_batch;
+	bool hugepages;
+	size_t window_size, pool_size;
+	struct buffer_pool *pool = nullptr;
+	vector<struct peer> peers;
+	map<uint32_t, struct lane *> qp_to_lane;
 
 	struct ibv_device **dev_list;
-	struct ibv_context *context;
+	struct ibv_context *context = nullptr;
 	struct ibv_pd *pd;
-	struct ibv_cq *send_cq, *write_cq;
+	struct ibv_comp_channel *channel;
+	struct ibv_cq *send_cq, *recv_cq;
 	struct ibv_qp_init_attr qp_init_attr;
-	struct ibv_qp *send_qp, *write_qp;
 	struct ibv_qp_attr qp_attr;
 	struct ibv_port_attr port_attr;
-	struct device_info local, remote;
+	struct ibv_device_attr dev_attr;
+	struct ibv_srq_init_attr srq_init_attr;
+	struct device_info local;
 	struct ibv_gid_entry gidEntries[255];
-	struct ibv_sge sg_send, sg_write, sg_recv;
-	struct ibv_send_wr wr_send, *bad_wr_send, wr_write, *bad_wr_write;
-	struct ibv_recv_wr wr_recv, *bad_wr_recv;
-	struct ibv_mr *send_mr, *write_mr, remote_write_mr;
-	struct ibv_wc wc;
+	struct ibv_wc wcs[16];
+	struct epoll_event ev;
 
 	auto flags = IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_WRITE |
 				 IBV_ACCESS_REMOTE_READ;
@@ -143,12 +703,50 @@ int main(int argc, char *argv[]) {
 	boost::program_options::options_description desc("Allowed options");
 	desc.add_options()("help", "show possible options")(
 		"dev", boost::program_options::value<string>(), "rdma device to use")(
-		"pipe", boost::program_options::value<string>(), "pipe")(
-		"datasize", boost::program_options::value<int>(), "datasize")(
-		"port", boost::program_options::value<int>(), "port")(
+		"rank", boost::program_options::value<int>(), "rank")(
+		"num_procs", boost::program_options::value<int>(), "num_procs")(
+		"addrs", boost::program_options::value<string>(),
+		"\"ip0:rank0 ip1:rank1 ..\"")(
+		"port", boost::program_options::value<int>(),
+		"port rank 0 collects and hands out the RDMA information on")(
 		"src_ip", boost::program_options::value<string>(), "source ip")(
-		"dst_ip", boost::program_options::value<string>(), "destination ip")(
-		"server", "run as server");
+		"slots", boost::program_options::value<int>()->default_value(16),
+		"receive slots per peer")(
+		"slot_size", boost::program_options::value<int>()->default_value(65536),
+		"bytes per receive slot, a larger message takes several slots")(
+		"hugepages", "back the registered buffers with 2MB pages")(
+		"sq_depth", boost::program_options::value<int>()->default_value(128),
+		"send queue depth of every QP")(
+		"signal_every", boost::program_options::value<int>()->default_value(16),
+		"request a completion every that many work requests")(
+		"batch", boost::program_options::value<int>()->default_value(16),
+		"work requests posted with one ibv_post_send")(
+		"qps", boost::program_options::value<int>()->default_value(1),
+		"QPs per peer, the messages are spread over them")(
+		"stripe_bytes",
+		boost::program_options::value<uint64_t>()->default_value(65536),
+		"messages and puts from that size on are split over all the QPs")(
+		"srq_batch", boost::program_options::value<int>()->default_value(16),
+		"receives put back into the shared receive queue with one call")(
+		"window_size",
+		boost::program_options::value<size_t>()->default_value(0),
+		"bytes of the window the algorithm puts from and into, 0 for none")(
+		"spin_us", boost::program_options::value<int>()->default_value(100),
+		"microseconds the progress loop polls without finding work before it "
+		"sleeps, -1 to never sleep")(
+		"coalesce_bytes",
+		boost::program_options::value<uint32_t>()->default_value(
+			RING_MAX_RECORD),
+		"largest write that records are merged into, at most the default")(
+		"coalesce_us", boost::program_options::value<int>()->default_value(0),
+		"hold records back up to this many microseconds to merge them with "
+		"the next ones, 0 to send what is there right away")(
+		"stats", boost::program_options::value<string>(),
+		"write the counters and histograms as JSON to this file at exit")(
+		"metrics_port", boost::program_options::value<int>(),
+		"serve the counters and histograms to Prometheus on this port")(
+		"cpu", boost::program_options::value<int>(),
+		"run the progress loop on this cpu only");
 
 	boost::program_options::variables_map vm;
 	boost::program_options::store(
@@ -160,45 +758,136 @@ int main(int argc, char *argv[]) {
 		return 0;
 	}
 
+	if (vm.count("rank"))
+		myrank = vm["rank"].as<int>();
+	else {
+		cerr << "[rdma] the --rank argument is required" << endl;
+		return 1;
+	}
+
+	if (vm.count("num_procs"))
+		num_procs = vm["num_procs"].as<int>();
+	else {
+		cerr << "[rdma-" << myrank << "] the --num_procs argument is required"
+			 << endl;
+		return 1;
+	}
+
+	if (vm.count("addrs"))
+		addrs = vm["addrs"].as<string>();
+	else {
+		cerr << "[rdma-" << myrank << "] the --addrs argument is required"
+			 << endl;
+		return 1;
+	}
+
 	if (vm.count("dev"))
 		dev_str = vm["dev"].as<string>();
 	else
-		cerr << "[rdma-" << port << "] the --dev argument is required" << endl;
-
-	if (vm.count("datasize"))
-		datasize = vm["datasize"].as<int>();
-	else
-		cerr << "[rdma-" << port << "] the --datasize argument is required"
+		cerr << "[rdma-" << myrank << "] the --dev argument is required"
 			 << endl;
 
 	if (vm.count("port"))
 		port = vm["port"].as<int>();
-	else
-		cerr << "[rdma-" << port << "] the --port argument is required" << endl;
-
-	if (vm.count("pipe"))
-		pipe = vm["pipe"].as<string>();
-	else
-		cerr << "[rdma-" << port << "] the --pipe argument is required" << endl;
+	else {
+		cerr << "[rdma-" << myrank << "] the --port argument is required"
+			 << endl;
+		return 1;
+	}
 
 	if (vm.count("src_ip"))
 		ip_str = vm["src_ip"].as<string>();
 	else
-		cerr << "[rdma-" << port << "] the --src_ip argument is required"
+		cerr << "[rdma-" << myrank << "] the --src_ip argument is required"
 			 << endl;
 
-	if (vm.count("dst_ip"))
-		remote_ip_str = vm["dst_ip"].as<string>();
-	else
-		cerr << "[rdma-" << port << "] the --dst_ip argument is required"
+	num_slots = vm["slots"].as<int>();
+	slot_size = vm["slot_size"].as<int>();
+	hugepages = vm.count("hugepages");
+	sq_depth = vm["sq_depth"].as<int>();
+	signal_every = min(vm["signal_every"].as<int>(), sq_depth);
+	batch = min(vm["batch"].as<int>(), MAX_BATCH);
+	srq_batch = max(vm["srq_batch"].as<int>(), 1);
+	num_qps = vm["qps"].as<int>();
+	if (num_qps < 1 || num_qps > MAX_QPS) {
+		cerr << "[rdma-" << myrank << "] --qps must be in 1 .. " << MAX_QPS
 			 << endl;
+		return 1;
+	}
+	// a part is at least 8 bytes
+	stripe_bytes =
+		max(vm["stripe_bytes"].as<uint64_t>(), (uint64_t)8 * MAX_QPS);
+	window_size = vm["window_size"].as<size_t>();
+	spin_us = vm["spin_us"].as<int>();
+	coalesce_bytes = min(vm["coalesce_bytes"].as<uint32_t>(),
+						 (uint32_t)RING_MAX_RECORD);
+	coalesce_us = vm["coalesce_us"].as<int>();
+	if (vm.count("stats")) stats_file = vm["stats"].as<string>();
+
+	// one entry for every rank on another node, in the order of --addrs.
+	// The ranks with our ip are on our node, their algorithms share the rings
+	// with ours directly and never go through us.
+	{
+		istringstream iss(addrs);
+		vector<struct peer> all;
+		string a, my_ip;
+
+		while (iss >> a) {
+			struct peer p = {};
+			p.ip = a.substr(0, a.find(':'));
+			p.rank = stoi(a.substr(a.find(':') + 1));
+			if (p.rank == 0) root_ip = p.ip;
+			if (p.rank == myrank) my_ip = p.ip;
+			all.push_back(p);
+		}
+
+		if ((int)all.size() != num_procs || my_ip.empty()) {
+			cerr << "[rdma-" << myrank << "] --addrs has " << all.size()
+				 << " ranks, expected " << num_procs << " including "
+				 << myrank << endl;
+			return 1;
+		}
+
+		for (auto &p : all)
+			if (p.ip != my_ip) peers.push_back(p);
+	}
 
-	if (vm.count("server")) server = true;
+	// then every rank is on this node, and so is every rdma process
+	if (peers.empty()) {
+		cerr << "[rdma-" << myrank << "] all the ranks are on this node"
+			 << endl;
+		return 0;
+	}
+
+	peer_stats = new struct peer_stats[num_procs]();
+	for (auto &p : peers) p.stats = &peer_stats[p.rank];
+
+	// the progress loop is the one thread that drives the NIC for every
+	// rank of ours; pinned, it keeps its caches and is not moved around
+	// while it spins
+	if (vm.count("cpu")) {
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		CPU_SET(vm["cpu"].as<int>(), &set);
+		if (sched_setaffinity(0, sizeof(set), &set) != 0) {
+			cerr << "[rdma-" << myrank << "] can not run on cpu "
+				 << vm["cpu"].as<int>() << ": " << strerror(errno) << endl;
+			return 1;
+		}
+	}
+
+	if (vm.count("metrics_port") &&
+		!stats_serve(vm["metrics_port"].as<int>(),
+					 [&peers] { return stats_prom(peers); })) {
+		cerr << "[rdma-" << myrank << "] can not serve the metrics: "
+			 << strerror(errno) << endl;
+		return 1;
+	}
 
 	// populate dev_list using ibv_get_device_list - use num_devices as argument
 	dev_list = ibv_get_device_list(&num_devices);
 	if (!dev_list) {
-		cerr << "[rdma-" << port
+		cerr << "[rdma-" << myrank
 			 << "] ibv_get_device_list failed: " << strerror(errno) << endl;
 		return 1;
 	}
@@ -207,7 +896,7 @@ int main(int argc, char *argv[]) {
 		// get the device name, using ibv_get_device_name
 		auto dev = ibv_get_device_name(dev_list[i]);
 		if (!dev) {
-			cerr << "[rdma-" << port
+			cerr << "[rdma-" << myrank
 				 << "] ibv_get_device_name failed: " << strerror(errno) << endl;
 			goto free_devlist;
 		}
@@ -220,62 +909,98 @@ int main(int argc, char *argv[]) {
 		}
 	}
 
+	if (!context) {
+		cerr << "[rdma-" << myrank << "] could not open device " << dev_str
+			 << endl;
+		goto free_devlist;
+	}
+
 	// allocate a PD (protection domain), using ibv_alloc_pd
 	pd = ibv_alloc_pd(context);
 	if (!pd) {
-		cerr << "[rdma-" << port << "] ibv_alloc_pd failed: " << strerror(errno)
-			 << endl;
+		cerr << "[rdma-" << myrank
+			 << "] ibv_alloc_pd failed: " << strerror(errno) << endl;
 		goto free_context;
 	}
 
-	// create a CQ (completion queue) for the send operations, using
-	// ibv_create_cq
-	send_cq = ibv_create_cq(context, 0x10, nullptr, nullptr, 0);
+	// both CQs report to one completion channel, the progress loop sleeps on
+	// it; non-blocking, so it can be emptied after waking up
+	channel = ibv_create_comp_channel(context);
+	if (!channel) {
+		cerr << "[rdma-" << myrank << "] ibv_create_comp_channel failed: "
+			 << strerror(errno) << endl;
+		goto free_pd;
+	}
+
+	if (fcntl(channel->fd, F_SETFL,
+			  fcntl(channel->fd, F_GETFL) | O_NONBLOCK) == -1) {
+		cerr << "[rdma-" << myrank << "] fcntl failed: " << strerror(errno)
+			 << endl;
+		goto free_channel;
+	}
+
+	// all peers share one CQ for the writes they post and one for the writes
+	// they receive; each lane has at most sq_depth work requests and each
+	// peer num_slots messages of up to num_qps parts outstanding
+	send_cq = ibv_create_cq(context, sq_depth * num_qps * num_procs, nullptr,
+							channel, 0);
 	if (!send_cq) {
-		cerr << "[rdma-" << port
+		cerr << "[rdma-" << myrank
 			 << "] ibv_create_cq - send - failed: " << strerror(errno) << endl;
-		goto free_pd;
+		goto free_channel;
 	}
 
-	// create a CQ for the write operations, using ibv_create_cq
-	write_cq = ibv_create_cq(context, 0x10, nullptr, nullptr, 0);
-	if (!write_cq) {
-		cerr << "[rdma-" << port
+	recv_cq = ibv_create_cq(context, num_slots * num_qps * num_procs, nullptr,
+							channel, 0);
+	if (!recv_cq) {
+		cerr << "[rdma-" << myrank
 			 << "] ibv_create_cq - recv - failed: " << strerror(errno) << endl;
 		goto free_send_cq;
 	}
 
-	memset(&qp_init_attr, 0, sizeof(qp_init_attr));
+	// one receive queue for all QPs, instead of num_slots receives per QP
+	// that sit idle while other peers are busy
+	if (ibv_query_device(context, &dev_attr) != 0) {
+		cerr << "[rdma-" << myrank
+			 << "] ibv_query_device failed: " << strerror(errno) << endl;
+		goto free_recv_cq;
+	}
 
-	qp_init_attr.recv_cq = send_cq;
-	qp_init_attr.send_cq = send_cq;
+	memset(&srq_init_attr, 0, sizeof(srq_init_attr));
+	srq_init_attr.attr.max_wr = peers.size() * num_slots * num_qps + srq_batch;
+	srq_init_attr.attr.max_sge = 1;
 
-	qp_init_attr.qp_type = IBV_QPT_RC;
-	qp_init_attr.sq_sig_all = 1;
+	if (srq_init_attr.attr.max_wr > (uint32_t)dev_attr.max_srq_wr) {
+		cerr << "[rdma-" << myrank << "] the shared receive queue needs "
+			 << srq_init_attr.attr.max_wr << " receives, the device has "
+			 << dev_attr.max_srq_wr << endl;
+		goto free_recv_cq;
+	}
 
-	qp_init_attr.cap.max_send_wr = 5;
-	qp_init_attr.cap.max_recv_wr = 5;
-	qp_init_attr.cap.max_send_sge = 1;
-	qp_init_attr.cap.max_recv_sge = 1;
+	srq = ibv_create_srq(pd, &srq_init_attr);
+	if (!srq) {
+		cerr << "[rdma-" << myrank
+			 << "] ibv_create_srq failed: " << strerror(errno) << endl;
+		goto free_recv_cq;
+	}
 
-	// create a QP (queue pair) for the send operations, using ibv_create_qp
-	send_qp = ibv_create_qp(pd, &qp_init_attr);
-	if (!send_qp) {
-		cerr << "[rdma-" << port
-			 << "] ibv_create_qp failed: " << strerror(errno) << endl;
-		goto free_write_cq;
+	srq_wrs.resize(srq_batch);
+	for (int i = 0; i < srq_batch; i++) {
+		memset(&srq_wrs[i], 0, sizeof(srq_wrs[i]));
+		srq_wrs[i].next = i + 1 < srq_batch ? &srq_wrs[i + 1] : nullptr;
 	}
 
-	qp_init_attr.recv_cq = write_cq;
-	qp_init_attr.send_cq = write_cq;
+	memset(&qp_init_attr, 0, sizeof(qp_init_attr));
 
-	// create a QP for the write operations, using ibv_create_qp
-	write_qp = ibv_create_qp(pd, &qp_init_attr);
-	if (!write_qp) {
-		cerr << "[rdma-" << port
-			 << "] ibv_create_qp failed: " << strerror(errno) << endl;
-		goto free_send_qp;
-	}
+	qp_init_attr.recv_cq = recv_cq;
+	qp_init_attr.srq = srq;
+	qp_init_attr.send_cq = send_cq;
+
+	qp_init_attr.qp_type = IBV_QPT_RC;
+	qp_init_attr.sq_sig_all = 0;
+
+	qp_init_attr.cap.max_send_wr = sq_depth;
+	qp_init_attr.cap.max_send_sge = 1;
 
 	memset(&qp_attr, 0, sizeof(qp_attr));
 
@@ -285,23 +1010,30 @@ int main(int argc, char *argv[]) {
 	qp_attr.qp_access_flags = IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_WRITE |
 							  IBV_ACCESS_REMOTE_READ;
 
-	// move both QPs in the INIT state, using ibv_modify_qp
-	ret = ibv_modify_qp(
-		send_qp, &qp_attr,
-		IBV_QP_STATE | IBV_QP_PKEY_INDEX | IBV_QP_PORT | IBV_QP_ACCESS_FLAGS);
-	if (ret != 0) {
-		cerr << "[rdma-" << port
-			 << "] ibv_modify_qp - INIT - failed: " << strerror(ret) << endl;
-		goto free_write_qp;
-	}
+	// --qps RC QPs per peer, each carries writes in both directions
+	for (auto &p : peers) {
+		p.lanes.resize(num_qps);
+		for (auto &l : p.lanes) {
+			l.peer = &p;
+			l.qp = ibv_create_qp(pd, &qp_init_attr);
+			if (!l.qp) {
+				cerr << "[rdma-" << myrank
+					 << "] ibv_create_qp failed: " << strerror(errno) << endl;
+				goto free_qps;
+			}
+			qp_to_lane[l.qp->qp_num] = &l;
 
-	ret = ibv_modify_qp(
-		write_qp, &qp_attr,
-		IBV_QP_STATE | IBV_QP_PKEY_INDEX | IBV_QP_PORT | IBV_QP_ACCESS_FLAGS);
-	if (ret != 0) {
-		cerr << "[rdma-" << port
-			 << "] ibv_modify_qp - INIT - failed: " << strerror(ret) << endl;
-		goto free_write_qp;
+			// move the QP in the INIT state, using ibv_modify_qp
+			ret = ibv_modify_qp(l.qp, &qp_attr,
+								IBV_QP_STATE | IBV_QP_PKEY_INDEX |
+									IBV_QP_PORT | IBV_QP_ACCESS_FLAGS);
+			if (ret != 0) {
+				cerr << "[rdma-" << myrank
+					 << "] ibv_modify_qp - INIT - failed: " << strerror(ret)
+					 << endl;
+				goto free_qps;
+			}
+		}
 	}
 
 	// use ibv_query_port to get information about port number 1
@@ -336,273 +1068,502 @@ int main(int argc, char *argv[]) {
 
 	// GID index 0 should never be used
 	if (gidIndex == 0) {
-		cerr << "[rdma-" << port << "] Given IP not found in GID table" << endl;
-		goto free_write_qp;
+		cerr << "[rdma-" << myrank << "] Given IP not found in GID table"
+			 << endl;
+		goto free_qps;
 	}
 
-	write_mr = ibv_reg_mr(pd, shared_buf, sizeof(shared_buf), flags);
-	if (!write_mr) {
-		cerr << "[rdma-" << port << "] ibv_reg_mr failed: " << strerror(errno)
-			 << endl;
-		goto free_send_mr;
+	// the receiver tells the messages in flight apart by their sequence
+	// number in the immediate
+	if (num_slots > (int)IMM_SEQ_MASK + 1) {
+		cerr << "[rdma-" << myrank << "] --slots must be at most "
+			 << IMM_SEQ_MASK + 1 << endl;
+		goto free_qps;
 	}
 
-	memcpy(&local.write_mr, write_mr, sizeof(local.write_mr));
-	local.send_qp_num = send_qp->qp_num;
-	local.write_qp_num = write_qp->qp_num;
+	// the largest message must fit in half the slots, see credit_batch
+	if (num_slots < 2 * max_msg_slots()) {
+		cerr << "[rdma-" << myrank << "] --slots must be at least "
+			 << 2 * max_msg_slots() << " with --slot_size " << slot_size
+			 << endl;
+		goto free_qps;
+	}
 
-	// exchange data between the 2 applications
-	if (server) {
-		ret = receive_data(remote);
-		if (ret != 0) {
-			cerr << "[rdma-" << port << "] receive_data failed: " << endl;
-			goto free_write_mr;
-		}
+	// freed slots are returned in batches. A sender stuck with u slots not
+	// returned yet needs u + nslots + skipped > num_slots, so with at most
+	// max_msg_slots() per message and skipped below that a batch of
+	// num_slots - 2 * max_msg_slots() + 2 always unblocks it.
+	credit_batch = num_slots - 2 * max_msg_slots() + 2;
+
+	// the receive slots of every peer and the credit words come from one
+	// pool, registered once: a cache line per peer for the credits it writes
+	// to us and the source of the credits we write to it. It is sized for
+	// the slabs taken below, in the same order
+	pool_size = 0;
+	for (size_t i = 0; i < peers.size(); i++) {
+		pool_size = pool_reserve(pool_size, (size_t)num_slots * slot_size);
+		pool_size = pool_reserve(pool_size, 64);
+		pool_size = pool_reserve(pool_size, 64);
+	}
+	pool = pool_create(pd, max(pool_size, (size_t)4096), hugepages, flags);
+	if (!pool) {
+		cerr << "[rdma-" << myrank
+			 << "] pool_create failed: " << strerror(errno) << endl;
+		goto free_qps;
+	}
 
-		ret = send_data(local, remote_ip_str);
-		if (ret != 0) {
-			cerr << "[rdma-" << port << "] send_data failed: " << endl;
-			goto free_write_mr;
+	// the window is registered as a whole, the algorithm places both the
+	// source and the destination of its puts in it
+	if (window_size) {
+		win = win_create(myrank, window_size);
+		if (!win) {
+			cerr << "[rdma-" << myrank
+				 << "] win_create failed: " << strerror(errno) << endl;
+			goto free_pool;
 		}
-	} else {
-		while (1) {
-			ret = send_data(local, remote_ip_str);
-			if (ret != 0) {
-				int secs = 5;
-				cerr << "[rdma-" << port
-					 << "] send_data failed, retrying in secs " << secs << endl;
-				sleep(secs);
-				continue;
-			}
 
-			ret = receive_data(remote);
-			if (ret != 0) {
-				cerr << "[rdma-" << port << "] receive_data failed: " << endl;
-				goto free_write_mr;
-			}
-			break;
+		win_mr = ibv_reg_mr(pd, win->base, win->size, flags);
+		if (!win_mr) {
+			cerr << "[rdma-" << myrank
+				 << "] ibv_reg_mr - window - failed: " << strerror(errno)
+				 << endl;
+			goto free_window;
 		}
 	}
 
-	memset(&qp_attr, 0, sizeof(qp_attr));
-
-	qp_attr.path_mtu = port_attr.active_mtu;
-	qp_attr.qp_state = ibv_qp_state::IBV_QPS_RTR;
-	qp_attr.rq_psn = 0;
-	qp_attr.max_dest_rd_atomic = 1;
-	qp_attr.min_rnr_timer = 0;
-	qp_attr.ah_attr.is_global = 1;
-	qp_attr.ah_attr.sl = 0;
-	qp_attr.ah_attr.src_path_bits = 0;
-	qp_attr.ah_attr.port_num = 1;
-
-	memcpy(&qp_attr.ah_attr.grh.dgid, &remote.gid, sizeof(remote.gid));
-
-	qp_attr.ah_attr.grh.flow_label = 0;
-	qp_attr.ah_attr.grh.hop_limit = 5;
-	qp_attr.ah_attr.grh.sgid_index = gidIndex;
-	qp_attr.ah_attr.grh.traffic_class = 0;
-
-	qp_attr.ah_attr.dlid = 1;
-	qp_attr.dest_qp_num = remote.send_qp_num;
+	// the writes are posted straight out of the out rings, the received data
+	// is copied into the in rings
+	for (size_t i = 0; i < peers.size(); i++) {
+		struct peer &p = peers[i];
+		string out_name =
+			"/ring-" + to_string(myrank) + "-" + to_string(p.rank);
+		string in_name = "/ring-" + to_string(p.rank) + "-" + to_string(myrank);
+
+		p.recv_buf = (char *)pool_alloc(pool, (size_t)num_slots * slot_size);
+		p.credits = (uint64_t *)pool_alloc(pool, 64);
+		p.credits_out = (uint64_t *)pool_alloc(pool, 64);
+		if (!p.recv_buf || !p.credits || !p.credits_out) {
+			cerr << "[rdma-" << myrank << "] buffer pool exhausted" << endl;
+			goto free_rings;
+		}
+		*p.credits = 0;
+		p.credit_lkey = pool->mr->lkey;
+		p.msg_imm.resize(num_slots);
+		p.msg_got.resize(num_slots);
+		// a lane with a work request in flight holds back the messages
+		// posted behind it, at most sq_depth + 1 of every num_qps
+		p.msg_release.resize(num_qps * (sq_depth + 1));
+		for (auto &l : p.lanes) {
+			l.msgs.resize(sq_depth);
+			l.time.resize(sq_depth);
+		}
 
-	// move the send QP into the RTR state, using ibv_modify_qp
-	ret = ibv_modify_qp(send_qp, &qp_attr,
-						IBV_QP_STATE | IBV_QP_AV | IBV_QP_PATH_MTU |
-							IBV_QP_DEST_QPN | IBV_QP_RQ_PSN |
-							IBV_QP_MAX_DEST_RD_ATOMIC | IBV_QP_MIN_RNR_TIMER);
+		p.out = ring_open(out_name);
+		p.in = ring_open(in_name);
+		if (!p.out || !p.in) {
+			cerr << "[rdma-" << myrank
+				 << "] ring_open failed: " << strerror(errno) << endl;
+			goto free_rings;
+		}
 
-	if (ret != 0) {
-		cerr << "[rdma-" << port
-			 << "] ibv_modify_qp - RTR - failed: " << strerror(ret) << endl;
-		goto free_write_mr;
+		p.out_mr = ibv_reg_mr(pd, p.out->data, p.out->capacity, flags);
+		if (!p.out_mr) {
+			cerr << "[rdma-" << myrank
+				 << "] ibv_reg_mr failed: " << strerror(errno) << endl;
+			goto free_rings;
+		}
 	}
 
-	qp_attr.dest_qp_num = remote.write_qp_num;
+	// every rank hands rank 0 what each of its peers needs and gets back
+	// what they have for it, in one round trip, see bootstrap.h
+	{
+		vector<struct device_info> mine(num_procs), theirs(num_procs);
+
+		for (auto &p : peers) {
+			local.num_qps = num_qps;
+			for (int q = 0; q < num_qps; q++)
+				local.qp_num[q] = p.lanes[q].qp->qp_num;
+			local.addr = (uintptr_t)p.recv_buf;
+			local.rkey = pool->mr->rkey;
+			local.credit_addr = (uintptr_t)p.credits;
+			local.credit_rkey = pool->mr->rkey;
+			local.win_addr = win_mr ? (uintptr_t)win->base : 0;
+			local.win_rkey = win_mr ? win_mr->rkey : 0;
+			mine[p.rank] = local;
+		}
 
-	// move the write QP into the RTR state, using ibv_modify_qp
-	ret = ibv_modify_qp(write_qp, &qp_attr,
-						IBV_QP_STATE | IBV_QP_AV | IBV_QP_PATH_MTU |
-							IBV_QP_DEST_QPN | IBV_QP_RQ_PSN |
-							IBV_QP_MAX_DEST_RD_ATOMIC | IBV_QP_MIN_RNR_TIMER);
+		if (bootstrap_exchange(root_ip, port, myrank, num_procs, mine.data(),
+							   sizeof(local), theirs.data()) != 0) {
+			cerr << "[rdma-" << myrank
+				 << "] bootstrap_exchange failed: " << strerror(errno) << endl;
+			goto free_rings;
+		}
 
-	if (ret != 0) {
-		cerr << "[rdma-" << port
-			 << "] ibv_modify_qp - RTR - failed: " << strerror(ret) << endl;
-		goto free_write_mr;
+		for (auto &p : peers) {
+			p.remote = theirs[p.rank];
+			if (p.remote.num_qps != (uint32_t)num_qps) {
+				cerr << "[rdma-" << myrank << "] rank " << p.rank << " has "
+					 << p.remote.num_qps << " QPs per peer, we have "
+					 << num_qps << endl;
+				goto free_rings;
+			}
+		}
 	}
 
-	qp_attr.qp_state = ibv_qp_state::IBV_QPS_RTS;
-	qp_attr.timeout = 0;
-	qp_attr.retry_cnt = 7;
-	qp_attr.rnr_retry = 7;
-	qp_attr.sq_psn = 0;
-	qp_attr.max_rd_atomic = 0;
-
-	// move the send and write QPs into the RTS state, using ibv_modify_qp
-	ret = ibv_modify_qp(send_qp, &qp_attr,
-						IBV_QP_STATE | IBV_QP_TIMEOUT | IBV_QP_RETRY_CNT |
-							IBV_QP_RNR_RETRY | IBV_QP_SQ_PSN |
-							IBV_QP_MAX_QP_RD_ATOMIC);
-	if (ret != 0) {
-		cerr << "[rdma-" << port
-			 << "] ibv_modify_qp - RTS - failed: " << strerror(ret) << endl;
-		goto free_write_mr;
+	// fill the shared receive queue before any QP can receive; a message
+	// never finds it empty, see srq
+	for (int left = srq_init_attr.attr.max_wr; left > 0; left -= srq_batch) {
+		ret = post_recvs(min(left, srq_batch));
+		if (ret != 0) {
+			cerr << "[rdma-" << myrank
+				 << "] ibv_post_srq_recv failed: " << strerror(ret) << endl;
+			goto free_rings;
+		}
 	}
 
-	ret = ibv_modify_qp(write_qp, &qp_attr,
-						IBV_QP_STATE | IBV_QP_TIMEOUT | IBV_QP_RETRY_CNT |
-							IBV_QP_RNR_RETRY | IBV_QP_SQ_PSN |
-							IBV_QP_MAX_QP_RD_ATOMIC);
-	if (ret != 0) {
-		cerr << "[rdma-" << port
-			 << "] ibv_modify_qp - RTS - failed: " << strerror(ret) << endl;
-		goto free_write_mr;
+	// connect the QPs, lane q to lane q of the peer
+	for (auto &p : peers)
+		for (int q = 0; q < num_qps; q++)
+			if (connect_qp(p.lanes[q].qp, p, p.remote.qp_num[q], port_attr,
+						   gidIndex) != 0)
+				goto free_rings;
+
+	// the progress loop sleeps on the completion channel and on the doorbell
+	// the algorithm rings through the out rings
+	bell = ring_bell_open(ring_bell_name(myrank));
+	if (bell == -1) {
+		cerr << "[rdma-" << myrank << "] open of the doorbell failed: "
+			 << strerror(errno) << endl;
+		goto free_rings;
 	}
 
-	if (server)
-		pipefd = open(pipe.c_str(), O_RDONLY);
-	else
-		pipefd = open(pipe.c_str(), O_WRONLY);
+	epfd = epoll_create1(0);
+	if (epfd == -1) {
+		cerr << "[rdma-" << myrank << "] epoll_create1 failed: "
+			 << strerror(errno) << endl;
+		goto free_rings;
+	}
 
-	if (pipefd == -1) {
-		cerr << "[rdma-" << port << "] open failed: " << strerror(errno)
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, channel->fd, &ev) == -1 ||
+		epoll_ctl(epfd, EPOLL_CTL_ADD, bell, &ev) == -1) {
+		cerr << "[rdma-" << myrank << "] epoll_ctl failed: " << strerror(errno)
 			 << endl;
-		return 1;
+		goto free_rings;
 	}
 
-	memset(shared_buf, 0x80, sizeof(shared_buf));
-
-	if (server) {
-		while (1) {
-			int ret;
-
-			memset(shared_buf, 0xff, sizeof(shared_buf));
+	// single progress loop serving every peer. It polls as long as it finds
+	// work and spin_us after that, then arms the CQs and the doorbells and
+	// sleeps until a completion or the algorithm wakes it.
+	num_done = 0;
+	armed = false;
+	last_work = now_us();
+	while (num_done < (int)peers.size()) {
+		// work: something moved in this pass; stalled: a peer waits for
+		// credits, ring space or the end of --coalesce_us, which nobody
+		// wakes us for
+		bool work = false, stalled = false;
+
+		stat_add(loop_stats.iterations, 1);
+
+		for (auto &p : peers) {
+			if (p.done) continue;
+
+			// ring_peek skips flush records, with nothing behind them and
+			// nothing in flight they are handed back here
+			if (!ring_peek(p.out) && sq_idle(p) &&
+				ring_tail(p.out) != p.out->cursor)
+				ring_release(p.out, p.out->cursor);
+
+			// the algorithm closing its side of the ring is the end of file;
+			// once the last write completed the peer gets the shutdown
+			// message and the QPs stay until the one of the peer arrived
+			// and the send queues are empty
+			if (ring_eof(p.out)) {
+				if (!p.shutdown_sent && ring_tail(p.out) == p.out->cursor) {
+					if (lane_space(p.lanes[0]) < 2 || !has_slots(p, 1)) {
+						stalled = true;
+						continue;
+					}
+
+					ret = post_shutdown(p);
+					if (ret != 0) {
+						cerr << "[rdma-" << myrank << "] ibv_post_send failed: "
+							 << strerror(ret) << endl;
+						goto free_rings;
+					}
+					work = true;
+				}
+
+				if (p.shutdown_sent && p.shutdown_got && sq_idle(p)) {
+					p.done = true;
+					num_done++;
+				}
+				continue;
+			}
 
-			ret = readall(pipefd, shared_buf, datasize);
-			if (ret != datasize) {
-				cerr << "[rdma-" << port << "] readall only read " << ret
-					 << " bytes: " << strerror(ret) << endl;
-				goto free_write_mr;
+			if (!batch_ready(p)) {
+				if (ring_peek(p.out)) stalled = true;
+				continue;
 			}
-			sleep(2);  // TODO: make this smaller
-
-			// initialise sg_write with the write mr address, size and lkey
-			memset(&sg_write, 0, sizeof(sg_write));
-			sg_write.addr = (uintptr_t)write_mr->addr;
-			sg_write.length = datasize;
-			sg_write.lkey = write_mr->lkey;
-
-			// create a work request, with the Write With Immediate operation
-			memset(&wr_write, 0, sizeof(wr_write));
-			wr_write.wr_id = 0;
-			wr_write.sg_list = &sg_write;
-			wr_write.num_sge = 1;
-			wr_write.opcode = IBV_WR_RDMA_WRITE_WITH_IMM;
-			wr_write.send_flags = IBV_SEND_SIGNALED;
-
-			wr_write.imm_data = htonl(0x1234);
-
-			// fill the wr.rdma field of wr_write with the remote address and
-			// key
-			wr_write.wr.rdma.remote_addr = (uintptr_t)remote.write_mr.addr;
-			wr_write.wr.rdma.rkey = remote.write_mr.rkey;
-
-			// post the work request, using ibv_post_send
-			errno = 0;
-			ret = ibv_post_send(write_qp, &wr_write, &bad_wr_write);
+
+			uint64_t posted = p.msg_posted;
+			ret = post_writes(p);
 			if (ret != 0) {
-				cerr << "[rdma-" << port
+				cerr << "[rdma-" << myrank
 					 << "] ibv_post_send failed: " << strerror(ret) << endl;
-				goto free_write_mr;
+				goto free_rings;
 			}
-			usleep(50000);
-		}
-	} else {
-		while (1) {
-			int ret;
-
-			// initialise sg_write with the write mr address, size and lkey
-			memset(&sg_recv, 0, sizeof(sg_recv));
-			sg_recv.addr = (uintptr_t)write_mr->addr;
-			sg_recv.length = datasize;
-			sg_recv.lkey = write_mr->lkey;
-
-			memset(&wr_recv, 0, sizeof(wr_recv));
-			wr_recv.wr_id = 0;
-			wr_recv.sg_list = &sg_recv;
-			wr_recv.num_sge = 1;
-
-			// post a receive work request, using ibv_post_recv, for the write
-			// QP
-			ret = ibv_post_recv(write_qp, &wr_recv, &bad_wr_recv);
-			if (ret != 0) {
-				cerr << "[rdma-" << port
-					 << "] ibv_post_recv failed: " << strerror(ret) << endl;
-				goto free_write_mr;
+			work |= p.msg_posted != posted;
+
+			// records left with room in the send queues wait for credits
+			if (ring_peek(p.out) && sq_room(p)) {
+				stat_add(p.stats->credit_stalls, 1);
+				stalled = true;
 			}
+		}
 
-			// poll write_cq, using ibv_poll_cq, until it returns different than
-			// 0
-			ret = 0;
-			do {
-				std::ifstream donefile("/tmp/done");
-				bool done;
-				donefile >> done;
-				if (done) goto free_write_mr;
+		ret = ibv_poll_cq(send_cq, 16, wcs);
+		if (ret < 0) {
+			cerr << "[rdma-" << myrank << "] ibv_poll_cq failed" << endl;
+			goto free_rings;
+		}
+		work |= ret > 0;
+		if (ret > 0) {
+			uint64_t now = now_us();
+			stat_add(loop_stats.completions, ret);
+			for (int i = 0; i < ret; i++) {
+				struct lane &l = *qp_to_lane[wcs[i].qp_num];
+				stat_add(l.peer->stats->completions, 1);
+				hist_add(l.peer->stats->completion_us,
+						 now - l.time[wcs[i].wr_id % sq_depth]);
+			}
+		}
+
+		for (int i = 0; i < ret; i++) {
+			struct lane &l = *qp_to_lane[wcs[i].qp_num];
+
+			if (wcs[i].status != ibv_wc_status::IBV_WC_SUCCESS) {
+				cerr << "[rdma-" << myrank << "] write to " << l.peer->rank
+					 << " failed: " << ibv_wc_status_str(wcs[i].status)
+					 << endl;
+				goto free_rings;
+			}
+
+			// the ring space can only be handed back to the algorithm once
+			// the NIC is done reading it
+			lane_completed(l, wcs[i].wr_id);
+		}
+
+		ret = ibv_poll_cq(recv_cq, 16, wcs);
+		if (ret < 0) {
+			cerr << "[rdma-" << myrank << "] ibv_poll_cq failed" << endl;
+			goto free_rings;
+		}
+		work |= ret > 0;
 
-				ret = ibv_poll_cq(write_cq, 1, &wc);
-			} while (ret == 0);
+		for (int i = 0; i < ret; i++) {
+			struct peer &p = *qp_to_lane[wcs[i].qp_num]->peer;
+			uint32_t imm = ntohl(wcs[i].imm_data);
+			uint64_t seq = imm >> IMM_SEQ_SHIFT & IMM_SEQ_MASK;
 
 			// check the wc (work completion) structure status;
 			//         return error on anything different than
 			//         ibv_wc_status::IBV_WC_SUCCESS
-			if (wc.status != ibv_wc_status::IBV_WC_SUCCESS) {
-				cerr << "[rdma-" << port
-					 << "] ibv_poll_cq failed: " << ibv_wc_status_str(wc.status)
+			if (wcs[i].status != ibv_wc_status::IBV_WC_SUCCESS) {
+				cerr << "[rdma-" << myrank << "] receive from " << p.rank
+					 << " failed: " << ibv_wc_status_str(wcs[i].status)
 					 << endl;
-				goto free_write_mr;
+				goto free_rings;
 			}
 
-			ret = writeall(pipefd, shared_buf, datasize);
-			if (ret != datasize) {
-				cerr << "[rdma-" << port << "] writeall only wrote " << ret
-					 << " bytes: " << strerror(ret) << endl;
-				goto free_write_mr;
+			if (!(imm & IMM_PUT) &&
+				(imm & IMM_LOW_MASK) * 8 > RING_MAX_RECORD) {
+				cerr << "[rdma-" << myrank << "] message of "
+					 << (imm & IMM_LOW_MASK) * 8 << " bytes from " << p.rank
+					 << endl;
+				goto free_rings;
+			}
+
+			// the lanes do not keep the messages in order between them.
+			// Less than num_slots messages are past the last one consumed,
+			// so the low bits of the sequence number tell which one it is.
+			seq = p.consumed + ((seq - p.consumed) & IMM_SEQ_MASK);
+			p.msg_imm[seq % num_slots] = imm;
+			p.msg_got[seq % num_slots]++;
+			srq_used++;
+
+			stat_add(p.stats->msgs_received, 1);
+			stat_add(p.stats->bytes_received, wcs[i].byte_len);
+		}
+
+		// below peers * num_slots receives left, put a batch back
+		while (srq_used >= srq_batch) {
+			ret = post_recvs(srq_batch);
+			if (ret != 0) {
+				cerr << "[rdma-" << myrank
+					 << "] ibv_post_srq_recv failed: " << strerror(ret) << endl;
+				goto free_rings;
 			}
+			srq_used -= srq_batch;
+			stat_add(loop_stats.srq_refills, 1);
 		}
+
+		// hand the received messages to the algorithm, every consumed slot
+		// is eventually returned to the sender
+		for (auto &p : peers) {
+			uint64_t consumed = p.consumed;
+
+			while (msg_landed(p)) {
+				uint32_t imm = p.msg_imm[p.consumed % num_slots];
+				uint32_t low = imm & IMM_LOW_MASK;
+				uint32_t len = imm & IMM_PUT || !low ? 1 : low * 8;
+				uint64_t start;
+				int nslots;
+
+				slot_place(p.freed, len, start, nslots);
+				char *buf = p.recv_buf + (start % num_slots) * slot_size;
+
+				// the data of a put is already in the window, the algorithm
+				// only learns about it
+				if (imm & IMM_PUT) {
+					uint32_t tag = low;
+					if (!ring_try_push(p.in, RING_NOTIFY, &tag, sizeof(tag)))
+						break;
+					p.consumed_off = len;
+				}
+
+				// the peer sends nothing after it, the algorithm sees end of
+				// file once it read the rest
+				if (!(imm & IMM_PUT) && !low) {
+					ring_close(p.in);
+					p.shutdown_got = true;
+					p.consumed_off = len;
+				}
+
+				while (p.consumed_off < len) {
+					struct ring_rec *rec =
+						(struct ring_rec *)(buf + p.consumed_off);
+					if (!ring_try_push(p.in, rec->type, ring_rec_data(rec),
+									   rec->len))
+						break;
+					p.consumed_off += ring_rec_size(rec->len);
+				}
+				if (p.consumed_off < len) break;
+
+				p.consumed_off = 0;
+				p.msg_got[p.consumed % num_slots] = 0;
+				p.consumed++;
+				p.freed = start + nslots;
+			}
+			work |= p.consumed != consumed;
+			if (msg_landed(p)) stalled = true;
+
+			// return credits in batches, see credit_batch; none after our
+			// shutdown, post_shutdown returned what was left
+			if (!p.shutdown_sent &&
+				p.freed - p.returned >= (uint64_t)credit_batch &&
+				lane_space(p.lanes[0]) > 0) {
+				ret = post_credits(p);
+				if (ret != 0) {
+					cerr << "[rdma-" << myrank
+						 << "] ibv_post_send failed: " << strerror(ret) << endl;
+					goto free_rings;
+				}
+				p.returned = p.freed;
+				work = true;
+			}
+		}
+
+		if (work) {
+			if (armed) {
+				for (auto &p : peers) ring_sleep(p.out, false);
+				armed = false;
+			}
+			last_work = now_us();
+			continue;
+		}
+
+		if (spin_us < 0 || now_us() - last_work < (uint64_t)spin_us) continue;
+
+		// what arrived before arming is found by one more pass, what arrives
+		// after it wakes us up
+		if (!armed) {
+			ret = arm(peers, send_cq, recv_cq);
+			if (ret != 0) {
+				cerr << "[rdma-" << myrank
+					 << "] ibv_req_notify_cq failed: " << strerror(ret) << endl;
+				goto free_rings;
+			}
+			armed = true;
+			continue;
+		}
+
+		struct epoll_event evs[2];
+		if (epoll_wait(epfd, evs, 2, stalled ? STALL_MS : -1) == -1 &&
+			errno != EINTR) {
+			cerr << "[rdma-" << myrank << "] epoll_wait failed: "
+				 << strerror(errno) << endl;
+			goto free_rings;
+		}
+
+		disarm(peers, channel, bell);
+		armed = false;
+		stat_add(loop_stats.sleeps, 1);
+		hist_add(loop_stats.sleep_us, now_us() - last_work - spin_us);
+		last_work = now_us();
 	}
 
-free_write_mr:
-	if (server) {
-		std::ofstream done("/tmp/done");
-		done << 1;
-		done.close();
+free_rings:
+	if (!stats_file.empty()) {
+		ofstream out(stats_file);
+		stats_json(out, peers);
+		if (!out)
+			cerr << "[rdma-" << myrank << "] could not write " << stats_file
+				 << endl;
 	}
 
-	// free write_mr, using ibv_dereg_mr
-	ibv_dereg_mr(write_mr);
+	if (epfd != -1) close(epfd);
+	if (bell != -1) close(bell);
 
-free_send_mr:
-	// free send_mr, using ibv_dereg_mr
-	ibv_dereg_mr(send_mr);
+	for (auto &p : peers) {
+		if (p.out_mr) ibv_dereg_mr(p.out_mr);
+		if (p.out) ring_unmap(p.out);
+		if (p.in) {
+			ring_close(p.in);
+			ring_unmap(p.in);
+		}
+	}
 
-free_write_qp:
-	// free write_qp, using ibv_destroy_qp
-	ibv_destroy_qp(write_qp);
+	if (win_mr) ibv_dereg_mr(win_mr);
 
-free_send_qp:
-	// free send_qp, using ibv_destroy_qp
-	ibv_destroy_qp(send_qp);
+free_window:
+	if (win) win_unmap(win);
 
-free_write_cq:
-	// free write_cq, using ibv_destroy_cq
-	ibv_destroy_cq(write_cq);
+free_pool:
+	// free the pool and its registration
+	pool_destroy(pool);
+
+free_qps:
+	// free the QPs, using ibv_destroy_qp
+	for (auto &p : peers)
+		for (auto &l : p.lanes)
+			if (l.qp) ibv_destroy_qp(l.qp);
+
+	ibv_destroy_srq(srq);
+
+free_recv_cq:
+	// free recv_cq, using ibv_destroy_cq
+	ibv_destroy_cq(recv_cq);
 
 free_send_cq:
 	// free send_cq, using ibv_destroy_cq
 	ibv_destroy_cq(send_cq);
 
+free_channel:
+	ibv_destroy_comp_channel(channel);
+
 free_pd:
 	// free pd, using ibv_dealloc_pd
 	ibv_dealloc_pd(pd);
@@ -0,0 +1,430 @@
+#ifndef SHM_RING_H
+#define SHM_RING_H
+
+#include <fcntl.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+// Single-producer single-consumer ring that lives in a POSIX shared memory
+// object (/dev/shm/ring-X-Y). It replaces the /tmp/pipe-X-Y FIFOs between the
+// algorithm process and the rdma process: the producer copies into the ring
+// without a syscall and the consumer either copies out of it (ring_read) or
+// uses the records in place (ring_peek / ring_advance / ring_release), e.g. as
+// the source of an RDMA write.
+//
+// The ring holds records, a ring_rec header followed by the payload padded to
+// 8 bytes. A record never wraps around the end of the ring, the producer fills
+// the tail end with a padding record instead, so the consumer can always hand
+// a record to the NIC as one contiguous buffer. The rdma process sends records
+// unchanged, header included, and the receiving side pushes them into its
+// ring, so a message carries its own length.
+//
+// The rdma process does not have to spin on its rings: before it goes to
+// sleep it sets sleeping in the header of the rings it consumes and the
+// producer then writes a byte into the doorbell of the ring, a FIFO the rdma
+// process waits on. While it is awake pushing costs no syscall.
+
+#define RING_HDR_SIZE 4096
+#define RING_CAPACITY (1 << 20)
+// largest record, header included; also the size of the buffers the rdma
+// process receives messages in
+#define RING_MAX_RECORD (RING_CAPACITY / 4)
+
+#define RING_PAD 0
+#define RING_DATA 1
+// a ring_put: the rdma process writes len bytes at src_off of the local window
+// to dst_off of the window of the peer, without going through the rings
+#define RING_PUT 2
+// a uint32_t tag: a ring_put of the peer with that tag landed in our window
+#define RING_NOTIFY 3
+// empty, ends a batch of records the rdma process may send as one write;
+// consumers skip it like padding
+#define RING_FLUSH 4
+
+struct ring_hdr {
+	// total number of bytes produced / consumed since the ring was created,
+	// head - tail is the number of bytes currently in the ring
+	alignas(64) std::atomic<uint64_t> head;
+	alignas(64) std::atomic<uint64_t> tail;
+	// set by the producer once it will not write anymore, the consumer sees
+	// end of file after draining the ring
+	alignas(64) std::atomic<uint32_t> closed;
+	// set by the consumer while it sleeps on the doorbell
+	alignas(64) std::atomic<uint32_t> sleeping;
+};
+
+struct ring_rec {
+	uint32_t len;
+	uint32_t type;
+};
+
+struct ring_put {
+	uint64_t src_off;
+	uint64_t dst_off;
+	uint64_t len;
+	uint32_t tag;
+};
+
+struct shm_ring {
+	struct ring_hdr *hdr;
+	char *data;
+	size_t capacity;
+	// consumer side only: next record to look at, it runs ahead of tail
+	// while the records before it are still in use
+	uint64_t cursor;
+	// consumer side only: bytes of the record at cursor ring_read already
+	// returned
+	uint32_t read_off;
+	// producer side only: the doorbell of the consumer, -1 for none
+	int doorbell;
+};
+
+inline size_t ring_rec_size(uint32_t len) {
+	return (sizeof(struct ring_rec) + len + 7) & ~(size_t)7;
+}
+
+inline char *ring_rec_data(struct ring_rec *rec) { return (char *)(rec + 1); }
+
+inline void ring_relax(unsigned &spins) {
+	if (++spins < 1024) {
+#if defined(__x86_64__) || defined(__i386__)
+		__builtin_ia32_pause();
+#endif
+	} else {
+		sched_yield();
+	}
+}
+
+// both ends call ring_open on the same name; whoever comes first creates the
+// object, ftruncate zeroes the header
+inline struct shm_ring *ring_open(const std::string &name) {
+	size_t size = RING_HDR_SIZE + RING_CAPACITY;
+	int fd;
+	void *addr;
+
+	fd = shm_open(name.c_str(), O_CREAT | O_RDWR, 0600);
+	if (fd == -1) return nullptr;
+
+	if (ftruncate(fd, size) == -1) {
+		close(fd);
+		return nullptr;
+	}
+
+	addr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (addr == MAP_FAILED) return nullptr;
+
+	struct shm_ring *r = new shm_ring;
+	r->hdr = (struct ring_hdr *)addr;
+	r->data = (char *)addr + RING_HDR_SIZE;
+	r->capacity = RING_CAPACITY;
+	r->cursor = r->hdr->tail.load(std::memory_order_relaxed);
+	r->read_off = 0;
+	r->doorbell = -1;
+	return r;
+}
+
+// a ring in private memory, for ranks that are threads of one process;
+// capacity has to be a multiple of 8
+inline struct shm_ring *ring_create(size_t capacity) {
+	size_t size = RING_HDR_SIZE + capacity;
+	void *addr;
+
+	addr = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+				MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (addr == MAP_FAILED) return nullptr;
+
+	struct shm_ring *r = new shm_ring;
+	r->hdr = (struct ring_hdr *)addr;
+	r->data = (char *)addr + RING_HDR_SIZE;
+	r->capacity = capacity;
+	r->cursor = 0;
+	r->read_off = 0;
+	r->doorbell = -1;
+	return r;
+}
+
+inline void ring_unmap(struct shm_ring *r) {
+	munmap(r->hdr, RING_HDR_SIZE + r->capacity);
+	delete r;
+}
+
+// the doorbell the rdma process of rank sleeps on
+inline std::string ring_bell_name(int rank) {
+	return "/dev/shm/bell-" + std::to_string(rank);
+}
+
+// both ends open the doorbell, a FIFO, read-write and non-blocking, so
+// neither waits for the other one to show up
+inline int ring_bell_open(const std::string &path) {
+	if (mkfifo(path.c_str(), 0600) == -1 && errno != EEXIST) return -1;
+	return open(path.c_str(), O_RDWR | O_NONBLOCK);
+}
+
+// consumer side, reads away the rings of the doorbell
+inline void ring_bell_drain(int fd) {
+	char buf[256];
+	while (read(fd, buf, sizeof(buf)) > 0) {
+	}
+}
+
+// consumer side, tells the producer whether to ring the doorbell; after
+// setting it the consumer has to look at the ring once more before it
+// sleeps, anything pushed before the store is not rung for
+inline void ring_sleep(struct shm_ring *r, bool sleeping) {
+	r->hdr->sleeping.store(sleeping, std::memory_order_seq_cst);
+}
+
+// producer side, wakes the consumer if it sleeps; the fence orders the
+// store of head before the load of sleeping, against the store of sleeping
+// before the load of head on the other side
+inline void ring_kick(struct shm_ring *r) {
+	char c = 0;
+
+	if (r->doorbell == -1) return;
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	if (r->hdr->sleeping.load(std::memory_order_relaxed))
+		(void)!write(r->doorbell, &c, 1);
+}
+
+inline void ring_close(struct shm_ring *r) {
+	r->hdr->closed.store(1, std::memory_order_release);
+	ring_kick(r);
+}
+
+inline bool ring_closed(struct shm_ring *r) {
+	return r->hdr->closed.load(std::memory_order_acquire);
+}
+
+// number of bytes the producer can write without blocking
+inline size_t ring_space(struct shm_ring *r) {
+	return r->capacity - (r->hdr->head.load(std::memory_order_relaxed) -
+						  r->hdr->tail.load(std::memory_order_acquire));
+}
+
+// producer side, true once the consumer gave back everything that was
+// written; for the rings of the rdma process that is once the last write
+// completed. Padding and flush records a reader that stopped reading never
+// gives back do not count.
+inline bool ring_drained(struct shm_ring *r) {
+	uint64_t pos = r->hdr->tail.load(std::memory_order_acquire);
+	uint64_t head = r->hdr->head.load(std::memory_order_relaxed);
+
+	while (pos != head) {
+		struct ring_rec *rec = (struct ring_rec *)(r->data + pos % r->capacity);
+		if (rec->type != RING_PAD && rec->type != RING_FLUSH) return false;
+		pos += ring_rec_size(rec->len);
+	}
+	return true;
+}
+
+// producer side, appends one record unless the ring is too full for it
+inline bool ring_try_push(struct shm_ring *r, uint32_t type, const void *buff,
+						  uint32_t len) {
+	uint64_t head = r->hdr->head.load(std::memory_order_relaxed);
+	size_t size = ring_rec_size(len);
+	size_t off = head % r->capacity;
+	size_t pad = r->capacity - off < size ? r->capacity - off : 0;
+	struct ring_rec *rec;
+
+	if (ring_space(r) < pad + size) return false;
+
+	if (pad) {
+		rec = (struct ring_rec *)(r->data + off);
+		rec->len = pad - sizeof(struct ring_rec);
+		rec->type = RING_PAD;
+		head += pad;
+		off = 0;
+	}
+
+	rec = (struct ring_rec *)(r->data + off);
+	rec->len = len;
+	rec->type = type;
+	memcpy(ring_rec_data(rec), buff, len);
+
+	r->hdr->head.store(head + size, std::memory_order_release);
+	ring_kick(r);
+	return true;
+}
+
+inline void ring_push(struct shm_ring *r, uint32_t type, const void *buff,
+					  uint32_t len) {
+	unsigned spins = 0;
+	while (!ring_try_push(r, type, buff, len)) ring_relax(spins);
+}
+
+// largest record, header included, that ring_write puts in r; RING_MAX_RECORD
+// for the rings of the rdma process
+inline size_t ring_max_record(struct shm_ring *r) {
+	return std::min((size_t)RING_MAX_RECORD, r->capacity / 4);
+}
+
+// producer side, blocks until all nbyte bytes are in the ring; they are
+// split in records of at most ring_max_record bytes
+inline ssize_t ring_write(struct shm_ring *r, const void *buff, size_t nbyte) {
+	const char *cbuff = (const char *)buff;
+	size_t max = ring_max_record(r) - sizeof(struct ring_rec);
+	size_t nwrote = 0;
+
+	do {
+		size_t chunk = std::min(nbyte - nwrote, max);
+		ring_push(r, RING_DATA, cbuff + nwrote, chunk);
+		nwrote += chunk;
+	} while (nwrote < nbyte);
+	return nwrote;
+}
+
+// producer side, like ring_write but returns as soon as the ring is full;
+// returns the number of bytes that went in, possibly 0
+inline size_t ring_try_write(struct shm_ring *r, const void *buff,
+							 size_t nbyte) {
+	const char *cbuff = (const char *)buff;
+	size_t max = ring_max_record(r) - sizeof(struct ring_rec);
+	size_t nwrote = 0;
+
+	while (nwrote < nbyte) {
+		size_t chunk = std::min(nbyte - nwrote, max);
+		if (!ring_try_push(r, RING_DATA, cbuff + nwrote, chunk)) break;
+		nwrote += chunk;
+	}
+	return nwrote;
+}
+
+// consumer side, the record at cursor or nullptr if the ring holds nothing
+// past cursor; padding and flush records are skipped
+inline struct ring_rec *ring_peek(struct shm_ring *r) {
+	while (r->hdr->head.load(std::memory_order_acquire) != r->cursor) {
+		struct ring_rec *rec =
+			(struct ring_rec *)(r->data + r->cursor % r->capacity);
+		if (rec->type != RING_PAD && rec->type != RING_FLUSH) return rec;
+		r->cursor += ring_rec_size(rec->len);
+	}
+	return nullptr;
+}
+
+// consumer side, whether a record of the given type is between pos and head;
+// moves pos up to it, or to head, so the next call goes on from there
+inline bool ring_holds(struct shm_ring *r, uint64_t &pos, uint32_t type) {
+	uint64_t head = r->hdr->head.load(std::memory_order_acquire);
+
+	while (pos != head) {
+		struct ring_rec *rec = (struct ring_rec *)(r->data + pos % r->capacity);
+		if (rec->type == type) return true;
+		pos += ring_rec_size(rec->len);
+	}
+	return false;
+}
+
+// consumer side, moves cursor past the record ring_peek returned
+inline void ring_advance(struct shm_ring *r) {
+	struct ring_rec *rec =
+		(struct ring_rec *)(r->data + r->cursor % r->capacity);
+	r->cursor += ring_rec_size(rec->len);
+	r->read_off = 0;
+}
+
+// consumer side, everything before tail was given back to the producer
+inline uint64_t ring_tail(struct shm_ring *r) {
+	return r->hdr->tail.load(std::memory_order_relaxed);
+}
+
+// consumer side, gives everything before pos back to the producer
+inline void ring_release(struct shm_ring *r, uint64_t pos) {
+	r->hdr->tail.store(pos, std::memory_order_release);
+}
+
+// consumer side, true once the producer closed the ring and every record was
+// looked at
+inline bool ring_eof(struct shm_ring *r) {
+	return ring_closed(r) && !ring_peek(r);
+}
+
+// consumer side, blocks until the next record arrives and copies its payload
+// into buff; returns the payload length, 0 at end of file or -1 if the record
+// is not of the expected type or longer than nbyte
+inline ssize_t ring_read_rec(struct shm_ring *r, uint32_t type, void *buff,
+							 size_t nbyte) {
+	struct ring_rec *rec;
+	unsigned spins = 0;
+	ssize_t len;
+
+	while (!(rec = ring_peek(r))) {
+		if (ring_eof(r)) return 0;
+		if (ring_tail(r) != r->cursor) ring_release(r, r->cursor);
+		ring_relax(spins);
+	}
+
+	if (rec->type != type || rec->len > nbyte) {
+		errno = EBADMSG;
+		return -1;
+	}
+
+	len = rec->len;
+	memcpy(buff, ring_rec_data(rec), len);
+	ring_advance(r);
+	ring_release(r, r->cursor);
+	return len;
+}
+
+// consumer side, copies out whatever is in the ring, up to nbyte bytes,
+// without blocking; returns the number of bytes read or -1 on a record that
+// is not RING_DATA
+inline ssize_t ring_try_read(struct shm_ring *r, void *buff, size_t nbyte) {
+	char *cbuff = (char *)buff;
+	size_t nread = 0;
+	struct ring_rec *rec;
+
+	while (nread < nbyte && (rec = ring_peek(r))) {
+		if (rec->type != RING_DATA) {
+			errno = EBADMSG;
+			return -1;
+		}
+
+		size_t chunk = std::min(nbyte - nread, (size_t)rec->len - r->read_off);
+		memcpy(cbuff + nread, ring_rec_data(rec) + r->read_off, chunk);
+		nread += chunk;
+		r->read_off += chunk;
+
+		if (r->read_off == rec->len) {
+			ring_advance(r);
+			ring_release(r, r->cursor);
+		}
+	}
+	// flush records ring_peek skipped at the end
+	if (ring_tail(r) != r->cursor) ring_release(r, r->cursor);
+	return nread;
+}
+
+// consumer side, blocks until nbyte bytes were read or the producer closed
+// the ring; like read(2) returns less than nbyte only at end of file. Record
+// boundaries are not preserved, a record may be returned over several calls.
+inline ssize_t ring_read(struct shm_ring *r, void *buff, size_t nbyte) {
+	char *cbuff = (char *)buff;
+	size_t nread = 0;
+	unsigned spins = 0;
+
+	while (nread < nbyte) {
+		ssize_t n = ring_try_read(r, cbuff + nread, nbyte - nread);
+		if (n < 0) return -1;
+		nread += n;
+
+		if (n > 0)
+			spins = 0;
+		else if (ring_eof(r))
+			break;
+		else
+			ring_relax(spins);
+	}
+	return nread;
+}
+
+#endif
@@ -0,0 +1,105 @@
+#ifndef SHM_WINDOW_H
+#define SHM_WINDOW_H
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <string>
+
+#include "shm_ring.h"
+
+// The window of a rank is a POSIX shared memory object (/dev/shm/win-R) that
+// the rdma process creates and registers at startup and the algorithm process
+// maps as well. Buffers allocated in it can be read and written by the NIC
+// directly: a RING_PUT record asks the rdma process to write from the local
+// window straight into the window of a peer. Every rank allocates the same
+// buffers in the same order, so a buffer has the same offset in every window
+// and a rank knows where its data goes on the peer.
+
+struct shm_window {
+	char *base;
+	size_t size;
+	// bump allocator, what it hands out lives as long as the mapping
+	size_t used;
+};
+
+inline std::string win_name(int rank) { return "/win-" + std::to_string(rank); }
+
+// rdma process side, size bytes zeroed
+inline struct shm_window *win_create(int rank, size_t size) {
+	int fd;
+	void *addr;
+
+	fd = shm_open(win_name(rank).c_str(), O_CREAT | O_RDWR, 0600);
+	if (fd == -1) return nullptr;
+
+	if (ftruncate(fd, size) == -1) {
+		close(fd);
+		return nullptr;
+	}
+
+	addr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (addr == MAP_FAILED) return nullptr;
+
+	struct shm_window *w = new shm_window;
+	w->base = (char *)addr;
+	w->size = size;
+	w->used = 0;
+	return w;
+}
+
+// algorithm process side, waits for the rdma process to create the window
+inline struct shm_window *win_attach(int rank) {
+	struct stat st;
+	unsigned spins = 0;
+	int fd;
+	void *addr;
+
+	while (1) {
+		fd = shm_open(win_name(rank).c_str(), O_RDWR, 0600);
+		if (fd != -1) {
+			if (fstat(fd, &st) == -1) {
+				close(fd);
+				return nullptr;
+			}
+			if (st.st_size > 0) break;
+			close(fd);
+		} else if (errno != ENOENT) {
+			return nullptr;
+		}
+		ring_relax(spins);
+	}
+
+	addr = mmap(nullptr, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd,
+				0);
+	close(fd);
+	if (addr == MAP_FAILED) return nullptr;
+
+	struct shm_window *w = new shm_window;
+	w->base = (char *)addr;
+	w->size = st.st_size;
+	w->used = 0;
+	return w;
+}
+
+inline void win_unmap(struct shm_window *w) {
+	munmap(w->base, w->size);
+	delete w;
+}
+
+// size bytes aligned to a cache line, or nullptr when the window is full
+inline void *win_alloc(struct shm_window *w, size_t size) {
+	size_t off = (w->used + 63) & ~(size_t)63;
+	if (off + size > w->size) return nullptr;
+	w->used = off + size;
+	return w->base + off;
+}
+
+inline uint64_t win_offset(struct shm_window *w, const void *p) {
+	return (const char *)p - w->base;
+}
+
+#endif
@@ -1,9 +1,9 @@
 #!/bin/bash -ex
  
-while getopts ":r:a:n:s:l:" option; do
+while getopts ":r:a:n:s:l:ck:g:w:q:z" option; do
   case $option in
     r)
-      rank="$OPTARG"
+      ranks="$OPTARG"
       ;;
     n)
       numprocs="$OPTARG"
@@ -17,41 +17,78 @@ while getopts ":r:a:n:s:l:" option; do
     l)
       algo="$OPTARG"
       ;;
+    c)
+      calibrate="--calibrate"
+      ;;
+    k)
+      radix="--radix $OPTARG"
+      ;;
+    g)
+      segment="--segment $OPTARG"
+      ;;
+    w)
+      window="--window $OPTARG"
+      ;;
+    q)
+      qps="--qps $OPTARG"
+      ;;
+    z)
+      zcopy="--zcopy"
+      ;;
     *)
-      echo "Usage: $0 [-r rank] [-n num_procs] [-a "ip0:rank0 ip1:rank1 .."] [-s source addr] [-l bruck|pairwise]"
+      echo "Usage: $0 [-r "rank0 rank1 .."] [-n num_procs] [-a "ip0:rank0 ip1:rank1 .."] [-s source addr] [-l bruck|pairwise|alltoall] [-c] [-k radix] [-g segment] [-w window] [-q qps] [-z]"
       exit 1
       ;;
   esac
 done
 
-if [ $rank -ge $numprocs ]
-then
-	echo "rank must be in interval [0, $numprocs]"
-	exit -1
-fi
+for rank in $ranks
+do
+	if [ $rank -ge $numprocs ]
+	then
+		echo "rank must be in interval [0, $numprocs]"
+		exit -1
+	fi
+done
 
 entries_per_cell=1
- 
-for a in $addrs
+port=9210
+# the window the zero copy algorithms put from and into
+window_size=$((64 << 20))
+
+# -r takes every rank of this node: they talk through the rings directly, so
+# the stale ones are dropped once, before any of them starts
+for rank in $ranks
 do
-	ip=`echo $a | awk -F':' '{print $1}'`
-	r=`echo $a | awk -F':' '{print $2}'`
-	pipe_read="/tmp/pipe-$rank-$r"
-	pipe_write="/tmp/pipe-$r-$rank"
+	for a in $addrs
+	do
+		r=`echo $a | awk -F':' '{print $2}'`
+		ring_read="/ring-$rank-$r"
+		ring_write="/ring-$r-$rank"
 
-	if [ $r -eq $rank ]
-	then
-		continue
-	fi
+		if [ $r -eq $rank ]
+		then
+			continue
+		fi
 
-	mkfifo $pipe_write
-	mkfifo $pipe_read
+		# drop rings left over from a previous run, their counters are stale
+		rm -f /dev/shm$ring_write /dev/shm$ring_read
+	done
 
-	port_server=`echo $src | awk -F'.' '{print $4}'``echo $ip | awk -F'.' '{print $4}'`
-	port_client=`echo $ip | awk -F'.' '{print $4}'``echo $src | awk -F'.' '{print $4}'`
-	
-	(./rdma --dev enp0s3rxe --src_ip $src --dst_ip $ip --port $port_server --server --pipe $pipe_read --datasize $((`cpp -dD /dev/null | grep __SIZEOF_INT__ | awk -F' ' '{print $3}'`*$entries_per_cell)) |& tee server-$port_server.out &)
-	(./rdma --dev enp0s3rxe --src_ip $src --dst_ip $ip --port $port_client --pipe $pipe_write --datasize $((`cpp -dD /dev/null | grep __SIZEOF_INT__ | awk -F' ' '{print $3}'`*$entries_per_cell)) |& tee client-$port_client.out &)
+	rm -f /dev/shm/win-$rank
 done
 
-(./$algo --rank $rank --num_procs $numprocs --entries_per_cell $entries_per_cell |& tee $algo.out &)
+# the alltoall front end learns from the addresses which ranks share a node,
+# the zero copy pairwise checks that none do
+if [ "$algo" == "alltoall" ] || [ -n "$zcopy" ]
+then
+	nodes="--addrs"
+fi
+
+for rank in $ranks
+do
+	# a single rdma process serves all the peers of this rank on other nodes
+	(./rdma --dev enp0s3rxe --src_ip $src --rank $rank --num_procs $numprocs --addrs "$addrs" --port $port --window_size $window_size $qps --stats rdma-stats-$rank.json |& tee rdma-$rank.out &)
+
+	(./$algo --rank $rank --num_procs $numprocs --entries_per_cell $entries_per_cell $calibrate $radix $segment $window $zcopy ${nodes:+$nodes "$addrs"} |& tee $algo-$rank.out &)
+done
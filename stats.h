@@ -0,0 +1,153 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <ostream>
+#include <string>
+#include <thread>
+
+// Counters and latency histograms the rdma process and the algorithms keep
+// about themselves, dumped as JSON at exit and, for the rdma process, served
+// in the Prometheus text format. A counter has one writer, the thread doing
+// the work, and may be read by another one, the metrics endpoint, so it is an
+// atomic updated with a plain load and store: no locked instruction on the
+// fast path.
+//
+// A histogram counts microseconds in power-of-two buckets: bucket 0 holds
+// what took less than 1us, bucket i what took less than 2^i us, the last one
+// everything else.
+
+#define STAT_BUCKETS 24
+
+typedef std::atomic<uint64_t> stat_counter;
+
+struct stat_hist {
+	stat_counter count;
+	stat_counter sum;
+	stat_counter buckets[STAT_BUCKETS];
+};
+
+inline double stat_now_us() {
+	return std::chrono::duration<double, std::micro>(
+			   std::chrono::steady_clock::now().time_since_epoch())
+		.count();
+}
+
+inline void stat_add(stat_counter &c, uint64_t v) {
+	c.store(c.load(std::memory_order_relaxed) + v, std::memory_order_relaxed);
+}
+
+inline uint64_t stat_get(const stat_counter &c) {
+	return c.load(std::memory_order_relaxed);
+}
+
+inline void hist_add(struct stat_hist &h, uint64_t us) {
+	int b = us ? 64 - __builtin_clzll(us) : 0;
+
+	stat_add(h.count, 1);
+	stat_add(h.sum, us);
+	stat_add(h.buckets[b < STAT_BUCKETS ? b : STAT_BUCKETS - 1], 1);
+}
+
+// {"count": n, "sum_us": s, "buckets_us": {"1": n0, "2": n1, ..., "+Inf": n}},
+// a bucket keyed by its upper bound and only if it is not empty
+inline void hist_json(std::ostream &out, const struct stat_hist &h) {
+	bool first = true;
+
+	out << "{\"count\": " << stat_get(h.count)
+		<< ", \"sum_us\": " << stat_get(h.sum) << ", \"buckets_us\": {";
+	for (int b = 0; b < STAT_BUCKETS; b++) {
+		if (!stat_get(h.buckets[b])) continue;
+		out << (first ? "" : ", ") << "\"";
+		if (b < STAT_BUCKETS - 1)
+			out << (1ull << b);
+		else
+			out << "+Inf";
+		out << "\": " << stat_get(h.buckets[b]);
+		first = false;
+	}
+	out << "}}";
+}
+
+inline void counter_prom(std::ostream &out, const std::string &name,
+						 const std::string &labels, uint64_t v) {
+	out << name << "{" << labels << "} " << v << "\n";
+}
+
+// a Prometheus histogram, its buckets are cumulative and le is in seconds
+inline void hist_prom(std::ostream &out, const std::string &name,
+					  const std::string &labels, const struct stat_hist &h) {
+	uint64_t cum = 0;
+
+	for (int b = 0; b < STAT_BUCKETS - 1; b++) {
+		cum += stat_get(h.buckets[b]);
+		out << name << "_bucket{" << labels << ",le=\"" << (1ull << b) / 1e6
+			<< "\"} " << cum << "\n";
+	}
+	out << name << "_bucket{" << labels << ",le=\"+Inf\"} "
+		<< stat_get(h.count) << "\n";
+	out << name << "_sum{" << labels << "} " << stat_get(h.sum) / 1e6 << "\n";
+	out << name << "_count{" << labels << "} " << stat_get(h.count) << "\n";
+}
+
+// answers every HTTP request on port with the page render returns, from a
+// thread of its own that lives as long as the process; false if the port
+// can not be listened on
+inline bool stats_serve(int port, std::function<std::string()> render) {
+	struct sockaddr_in addr;
+	int sockfd, one = 1;
+
+	sockfd = socket(AF_INET, SOCK_STREAM, 0);
+	if (sockfd == -1) return false;
+
+	setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_ANY);
+	addr.sin_port = htons(port);
+
+	if (bind(sockfd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+		listen(sockfd, 16) != 0) {
+		close(sockfd);
+		return false;
+	}
+
+	std::thread([sockfd, render] {
+		char req[4096];
+
+		for (;;) {
+			int connfd = accept(sockfd, NULL, NULL);
+			if (connfd == -1) continue;
+
+			// whatever was asked for, there is only one page
+			(void)!read(connfd, req, sizeof(req));
+
+			std::string body = render();
+			std::string resp =
+				"HTTP/1.0 200 OK\r\n"
+				"Content-Type: text/plain; version=0.0.4\r\n"
+				"Content-Length: " +
+				std::to_string(body.size()) + "\r\n\r\n" + body;
+
+			for (size_t off = 0; off < resp.size();) {
+				ssize_t n = write(connfd, resp.data() + off, resp.size() - off);
+				if (n <= 0) break;
+				off += n;
+			}
+			close(connfd);
+		}
+	}).detach();
+
+	return true;
+}
+
+#endif
@@ -0,0 +1,56 @@
+#ifndef TRANSPORT_H
+#define TRANSPORT_H
+
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+
+#include <sys/types.h>
+
+// What the algorithms need from the layer that moves their data. They call
+// rread / rwrite and friends (comm.h), which go to the transport of the rank:
+// the shared memory rings to its rdma process (comm.h) or, with every rank a
+// thread of a single process, in-memory queues between the threads
+// (loopback.h).
+//
+// read and write behave like ring_read and ring_write, the try_ versions move
+// whatever fits and never block.
+
+struct transport {
+	int rank;
+	int num_procs;
+
+	virtual ~transport() {}
+
+	virtual ssize_t read(int from, void *buff, size_t nbyte) = 0;
+	virtual ssize_t write(int to, const void *buff, size_t nbyte) = 0;
+	virtual ssize_t try_read(int from, void *buff, size_t nbyte) = 0;
+	virtual size_t try_write(int to, const void *buff, size_t nbyte) = 0;
+
+	// zero copy puts into the window of a peer, see shm_window.h; only the
+	// rdma process can do them
+	virtual void put(int /* to */, uint64_t /* src_off */,
+					 uint64_t /* dst_off */, uint64_t /* len */,
+					 uint32_t /* tag */) {
+		std::cerr << "[" << rank << "] the transport has no puts" << std::endl;
+		exit(-1);
+	}
+
+	virtual uint32_t wait_put(int /* from */) {
+		std::cerr << "[" << rank << "] the transport has no puts" << std::endl;
+		exit(-1);
+	}
+
+	// returns once nothing written or put to "to" so far is still read out
+	// of our buffers, the sources of the puts may be reused then
+	virtual void wait_sent(int /* to */) {}
+
+	// the data written to "to" so far is a batch, the rdma process does not
+	// hold it back to merge it with what comes next
+	virtual void flush(int /* to */) {}
+
+	// after the last write, the peers see end of file once they drained it
+	virtual void close() = 0;
+};
+
+#endif